@@ -0,0 +1,128 @@
+/*
+Compare the split policies on build (insert) cost, lookup cost and index size
+for uniform and skewed key distributions.
+
+Usage: Assignment3_Benchmark [records]
+*/
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <sys/stat.h>
+#include "classes.h"
+using namespace std;
+
+static const string CSV_NAME = "benchmark.csv";
+static const string INDEX_NAME = "benchmark.idx";
+
+// Ids for the benchmark. Uniform ids are spread over the whole 31-bit range;
+// skewed ids put three in four on multiples of 64, so those crowd into one
+// bucket in 64.
+static vector<int64_t> makeIds(const string &distribution, size_t count, mt19937_64 &rng)
+{
+    uniform_int_distribution<int64_t> anyId(1, INT32_MAX);
+    vector<int64_t> ids;
+    ids.reserve(count);
+    for (size_t k = 0; k < count; k++) {
+        int64_t id = anyId(rng);
+        if (distribution == "skewed" && k % 4 != 0)
+            id &= ~(int64_t)63;
+        ids.push_back(id);
+    }
+
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    shuffle(ids.begin(), ids.end(), rng);
+    return ids;
+}
+
+// Write the ids as an Employee.csv style file with bios of 50 to 500 bytes
+static void writeCsv(const vector<int64_t> &ids, mt19937_64 &rng)
+{
+    static const char *words[] = {"lorem ", "ipsum ", "dolor ", "sit ", "amet ", "consectetur ", "adipiscing ", "elit "};
+    uniform_int_distribution<int> bioLength(50, 500);
+    uniform_int_distribution<int> word(0, 7);
+
+    ofstream out(CSV_NAME);
+    for (size_t k = 0; k < ids.size(); k++) {
+        string bio;
+        int length = bioLength(rng);
+        while ((int)bio.length() < length)
+            bio += words[word(rng)];
+        out << ids[k] << ",Employee " << k << ',' << bio << ',' << ids[(k + 1) % ids.size()] << '\n';
+    }
+}
+
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static int64_t fileSize(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static void runPolicy(const string &policyName, SplitPolicy policy, const vector<int64_t> &ids)
+{
+    IndexOptions options;
+    options.splitPolicy = policy;
+    LinearHashIndex index(INDEX_NAME, options);
+
+    auto start = chrono::steady_clock::now();
+    index.createFromFile(CSV_NAME);
+    double buildSeconds = secondsSince(start);
+
+    start = chrono::steady_clock::now();
+    size_t missing = 0;
+    for (int64_t id : ids) {
+        if (index.findRecordById(id).id != id)
+            missing++;
+    }
+    double lookupSeconds = secondsSince(start);
+
+    IndexStats stats = index.getStats();
+    cout << left << setw(14) << policyName << right << fixed << setprecision(2)
+         << setw(12) << buildSeconds * 1e6 / ids.size()
+         << setw(12) << lookupSeconds * 1e6 / ids.size()
+         << setw(10) << (double)fileSize(INDEX_NAME) / (1 << 20)
+         << setw(10) << stats.numBuckets
+         << setw(10) << stats.numOverflowBlocks
+         << setw(10) << stats.longestChain;
+    if (missing > 0)
+        cout << "  (" << missing << " ids not found)";
+    cout << endl;
+}
+
+int main(int argc, char *const argv[])
+{
+    size_t numRecords = argc > 1 ? stoul(argv[1]) : 50000;
+    mt19937_64 rng(440);
+
+    const char *distributions[] = {"uniform", "skewed"};
+    for (const char *distribution : distributions) {
+        vector<int64_t> ids = makeIds(distribution, numRecords, rng);
+        writeCsv(ids, rng);
+
+        cout << distribution << " keys, " << ids.size() << " records" << endl;
+        cout << left << setw(14) << "policy" << right << setw(12) << "insert us" << setw(12) << "lookup us"
+             << setw(10) << "MB" << setw(10) << "buckets" << setw(10) << "overflow" << setw(10) << "longest" << endl;
+        runPolicy("average-load", SplitPolicy::AVERAGE_LOAD, ids);
+        runPolicy("chain-length", SplitPolicy::CHAIN_LENGTH, ids);
+        runPolicy("hybrid", SplitPolicy::HYBRID, ids);
+        cout << endl;
+    }
+
+    remove(CSV_NAME.c_str());
+    remove(INDEX_NAME.c_str());
+    remove((INDEX_NAME + ".fsm").c_str());
+    remove((INDEX_NAME + ".dir").c_str());
+    return 0;
+}
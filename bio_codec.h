@@ -0,0 +1,170 @@
+#ifndef BIO_CODEC_H
+#define BIO_CODEC_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+using namespace std;
+
+// Word-level dictionary coder for the bio column. The dictionary is trained on
+// a sample of bios and holds the most profitable "word " tokens (a word plus
+// its trailing space). Each dictionary hit is written as a single byte:
+//   0x00 - 0x7F  literal ASCII byte
+//   0x80 - 0xFE  dictionary token (byte - 0x80)
+//   0xFF         escape, the next byte is a literal
+class BioCodec
+{
+private:
+    static const int MAX_WORDS = 127;
+    static const int MAX_WORD_LENGTH = 32;
+    static const unsigned char ESCAPE = 0xFF;
+
+    unordered_map<string, int> lookup;
+
+    // Length of the token starting at pos: up to and including the next space
+    static size_t tokenLength(const string &text, size_t pos)
+    {
+        size_t space = text.find(' ', pos);
+        if (space == string::npos)
+            return text.length() - pos;
+        return space - pos + 1;
+    }
+
+    void buildLookup()
+    {
+        lookup.clear();
+        for (size_t i = 0; i < words.size(); i++)
+            lookup[words[i]] = i;
+    }
+
+public:
+    vector<string> words;
+
+    bool empty() const
+    {
+        return words.empty();
+    }
+
+    // Pick the tokens that save the most bytes across the samples, keeping the
+    // serialized dictionary within maxBytes
+    void train(const vector<string> &samples, int maxBytes)
+    {
+        unordered_map<string, int64_t> counts;
+        for (size_t s = 0; s < samples.size(); s++)
+        {
+            const string &text = samples[s];
+            size_t pos = 0;
+            while (pos < text.length())
+            {
+                size_t len = tokenLength(text, pos);
+                if (len > 1 && len <= MAX_WORD_LENGTH)
+                    counts[text.substr(pos, len)]++;
+                pos += len;
+            }
+        }
+
+        vector<pair<int64_t, string>> scored;
+        for (auto &entry : counts)
+        {
+            // Only tokens seen more than once are worth a dictionary slot
+            if (entry.second > 1)
+                scored.push_back(make_pair(entry.second * (int64_t)(entry.first.length() - 1), entry.first));
+        }
+        sort(scored.begin(), scored.end(), [](const pair<int64_t, string> &a, const pair<int64_t, string> &b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+
+        words.clear();
+        int used = sizeof(uint16_t);
+        for (size_t i = 0; i < scored.size() && words.size() < MAX_WORDS; i++)
+        {
+            int entryBytes = 1 + scored[i].second.length();
+            if (used + entryBytes > maxBytes)
+                break;
+            words.push_back(scored[i].second);
+            used += entryBytes;
+        }
+        buildLookup();
+    }
+
+    string encode(const string &text) const
+    {
+        string out;
+        out.reserve(text.length());
+
+        size_t pos = 0;
+        while (pos < text.length())
+        {
+            size_t len = tokenLength(text, pos);
+            auto hit = lookup.find(text.substr(pos, len));
+            if (hit != lookup.end())
+            {
+                out.push_back((char)(0x80 + hit->second));
+            }
+            else
+            {
+                for (size_t i = pos; i < pos + len; i++)
+                {
+                    if ((unsigned char)text[i] >= 0x80)
+                        out.push_back((char)ESCAPE);
+                    out.push_back(text[i]);
+                }
+            }
+            pos += len;
+        }
+        return out;
+    }
+
+    string decode(const string &data) const
+    {
+        string out;
+        out.reserve(data.length() * 3);
+
+        for (size_t i = 0; i < data.length(); i++)
+        {
+            unsigned char b = data[i];
+            if (b < 0x80)
+                out.push_back(b);
+            else if (b == ESCAPE && i + 1 < data.length())
+                out.push_back(data[++i]);
+            else if (b - 0x80 < (int)words.size())
+                out += words[b - 0x80];
+        }
+        return out;
+    }
+
+    // Dictionary layout: [count:uint16] then per word [length:uint8][bytes]
+    string serialize() const
+    {
+        string out;
+        uint16_t count = words.size();
+        out.append(reinterpret_cast<const char *>(&count), sizeof(count));
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            out.push_back((char)words[i].length());
+            out += words[i];
+        }
+        return out;
+    }
+
+    void deserialize(const char *src)
+    {
+        uint16_t count;
+        memcpy(&count, src, sizeof(count));
+        src += sizeof(count);
+
+        words.clear();
+        for (int i = 0; i < count; i++)
+        {
+            unsigned char len = *src++;
+            words.push_back(string(src, len));
+            src += len;
+        }
+        buildLookup();
+    }
+};
+
+#endif
@@ -1,5 +1,11 @@
+#ifndef CLASSES_H
+#define CLASSES_H
+
 #include <string>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
 #include <iostream>
 #include <sstream>
 #include <bitset>
@@ -7,20 +13,124 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <functional>
+#include <mutex>
+#include <algorithm>
+#include "bio_codec.h"
+#include "page_io.h"
+#include "crc32c.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KEYPROBE_X86 1
+#else
+#define KEYPROBE_X86 0
+#endif
+
 using namespace std;
 
+// What makes the index split its next bucket
+enum class SplitPolicy
+{
+    AVERAGE_LOAD, // Average bytes per bucket pass 70% of a page
+    CHAIN_LENGTH, // The chain an insert went to is longer than maxChainLength pages
+    HYBRID        // Either of the above
+};
+
+// When reads check a page against its checksum
+enum class ChecksumCheck
+{
+    EVERY_READ, // Every time a page is read or used in place
+    FIRST_READ  // Only the first time each page is used after the index is opened
+};
+
+// Options chosen when an index is created
+struct IndexOptions
+{
+    // Width of the keys stored in each page's key array: 4 (int32) or 8 (int64)
+    int keyWidth = sizeof(int32_t);
+
+    // Store name and bio in an append-only value heap file next to the index
+    // so bucket pages only hold (id, manager_id, value pointer)
+    bool separateValueHeap = false;
+
+    // Encode bios with a word dictionary trained on the input. Bios stay
+    // encoded in the pages and are only decoded for the record a lookup returns
+    bool compressBio = false;
+
+    // Queue batched page reads on io_uring when the kernel allows it,
+    // otherwise fall back to pread
+    bool useIoUring = true;
+
+    // Serve lookups from read-only memory mappings of the index and value heap
+    // instead of reading pages, prefetching the pages a lookup will need next
+    bool mapIndex = false;
+
+    // Keep the index and its sidecar files in memory. Nothing is written to
+    // disk until snapshot(); load() reads a saved index back into memory
+    bool inMemory = false;
+
+    // Open an existing index with load() for lookups only. Its files are
+    // opened read-only and inserts are refused
+    bool readOnly = false;
+
+    // When to split. Average load keeps chains short for read-heavy use;
+    // chain length packs pages fuller for append-heavy use
+    SplitPolicy splitPolicy = SplitPolicy::AVERAGE_LOAD;
+    int maxChainLength = 4;
+
+    // Checking on first read only costs one CRC per page per open, so it suits
+    // mapped and in-memory indexes whose pages stay resident
+    ChecksumCheck checksumCheck = ChecksumCheck::EVERY_READ;
+};
+
+// Counters describing the shape of an index
+struct IndexStats
+{
+    int64_t numRecords;
+    int64_t numBuckets;
+    int64_t numBlocks;
+    int64_t numOverflowBlocks;
+    int64_t longestChain; // Pages in the longest bucket chain
+};
+
 class Record
 {
 public:
-    int id, manager_id;
+    int64_t id, manager_id;
     std::string bio, name;
 
+    // Location of name and bio in the value heap, -1 when stored inline
+    int64_t valueOffset;
+    int32_t valueLength;
+
+    // Fields a lookup can be limited to, as a mask. The id is always set;
+    // fields left out of the mask are not decoded and keep their old values.
+    static const uint32_t FIELD_MANAGER_ID = 1;
+    static const uint32_t FIELD_NAME = 2;
+    static const uint32_t FIELD_BIO = 4;
+    static const uint32_t VALUE_FIELDS = FIELD_NAME | FIELD_BIO; // Stored in the value
+    static const uint32_t ALL_FIELDS = FIELD_MANAGER_ID | VALUE_FIELDS;
+
+    Record()
+    {
+        id = -1;
+        manager_id = -1;
+        valueOffset = -1;
+        valueLength = 0;
+    }
+
     Record(vector<std::string> fields)
     {
-        id = stoi(fields[0]);
+        id = stoll(fields[0]);
         name = fields[1];
         bio = fields[2];
-        manager_id = stoi(fields[3]);
+        manager_id = stoll(fields[3]);
+        valueOffset = -1;
+        valueLength = 0;
     }
 
     void print()
@@ -31,365 +141,2258 @@ public:
         cout << "\tMANAGER_ID: " << manager_id << "\n";
     }
 
+    // Size of name and bio with their length prefixes
+    int getValueSize() {
+        return 2 * sizeof(uint16_t) + name.length() + bio.length();
+    }
+
+    // Size of the payload stored in the page: manager id followed by either
+    // the value itself or its location in the value heap
+    int getPayloadSize(const IndexOptions &options) {
+        if (options.separateValueHeap)
+            return sizeof(int64_t) + sizeof(valueOffset) + sizeof(valueLength);
+        return sizeof(int64_t) + getValueSize();
+    }
+
     // Calculate size of record to determine if it can fit in block
-    int getSize() {
-        // Include the size for all fields, delimiters, and a newline
-        return to_string(id).length() + name.length() + bio.length() + to_string(manager_id).length() + 3 /* commas */ + 1 /* newline */;
+    int getSize(const IndexOptions &options) {
+        // Include the key slot, the payload offset slot and the payload itself
+        return options.keyWidth + sizeof(uint16_t) + getPayloadSize(options);
     }
 
-    void writeRecord(fstream &indexFile)
+    void writeValue(char *dest)
     {
-        indexFile << id << ',' << name << ',' << bio << ',' << manager_id << '\n';
+        uint16_t nameLen = name.length();
+        uint16_t bioLen = bio.length();
+
+        memcpy(dest, &nameLen, sizeof(nameLen));
+        memcpy(dest + 2, &bioLen, sizeof(bioLen));
+        memcpy(dest + 4, name.data(), nameLen);
+        memcpy(dest + 4 + nameLen, bio.data(), bioLen);
     }
-};
 
-class Block
-{
-private:
-    const int PAGE_SIZE = 4096;
+    void readValue(const char *src, uint32_t fields = ALL_FIELDS)
+    {
+        uint16_t nameLen, bioLen;
 
-public:
-    vector<Record> records;
+        memcpy(&nameLen, src, sizeof(nameLen));
+        memcpy(&bioLen, src + 2, sizeof(bioLen));
 
-    int blockSize;
-    int overflowPtrIdx;
-    int numRecords;
-    int blockIdx;
+        if (fields & FIELD_NAME)
+            name.assign(src + 4, nameLen);
+        if (fields & FIELD_BIO)
+            bio.assign(src + 4 + nameLen, bioLen);
+    }
 
-    Block()
+    // Serialize the payload (everything but the key) into dest
+    void writeRecord(char *dest, const IndexOptions &options)
     {
-        blockSize = 0;
-        blockIdx = 0;
+        memcpy(dest, &manager_id, sizeof(manager_id));
+        if (options.separateValueHeap)
+        {
+            memcpy(dest + 8, &valueOffset, sizeof(valueOffset));
+            memcpy(dest + 16, &valueLength, sizeof(valueLength));
+        }
+        else
+        {
+            writeValue(dest + 8);
+        }
     }
 
-    Block(int physIdx)
+    // Decode the fields in the mask. The value heap location is always read,
+    // as the caller needs it to fetch name or bio.
+    void readRecord(int64_t key, const char *src, const IndexOptions &options, uint32_t fields = ALL_FIELDS)
     {
-        blockSize = 0;
-        blockIdx = physIdx;
+        id = key;
+        if (fields & FIELD_MANAGER_ID)
+            memcpy(&manager_id, src, sizeof(manager_id));
+        if (options.separateValueHeap)
+        {
+            memcpy(&valueOffset, src + 8, sizeof(valueOffset));
+            memcpy(&valueLength, src + 16, sizeof(valueLength));
+        }
+        else if (fields & VALUE_FIELDS)
+        {
+            readValue(src + 8, fields);
+        }
     }
+};
 
-    void readBlock(fstream &inputFile)
+// Locate a key inside a page's key array. Keys are 4 or 8 bytes wide. Uses
+// AVX2 or SSE4.1 when the CPU supports them and falls back to a scalar loop
+// otherwise.
+class KeyProbe
+{
+private:
+    template <typename T>
+    static int findScalar(const char *keys, int n, T key)
     {
+        for (int i = 0; i < n; i++)
+        {
+            T k;
+            memcpy(&k, keys + i * sizeof(T), sizeof(k));
+            if (k == key)
+                return i;
+        }
+        return -1;
+    }
 
-        inputFile.seekg(blockIdx * PAGE_SIZE);
-
-        inputFile.read(reinterpret_cast<char *>(&overflowPtrIdx), sizeof(overflowPtrIdx));
-        inputFile.read(reinterpret_cast<char *>(&numRecords), sizeof(numRecords));
-
-        blockSize += 8;
-
-        for (int i = 0; i < numRecords; i++)
+#if KEYPROBE_X86
+    __attribute__((target("avx2"))) static int findAvx2(const char *keys, int n, int32_t key)
+    {
+        __m256i needle = _mm256_set1_epi32(key);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
         {
-            readRecord(inputFile);
-            blockSize += records[i].getSize();
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i * sizeof(int32_t)));
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(chunk, needle)));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
         }
+        int rest = findScalar<int32_t>(keys + i * sizeof(int32_t), n - i, key);
+        return rest == -1 ? -1 : i + rest;
     }
 
-    void readRecord(fstream &inputFile) {
-        string recordLine;
-        if (!getline(inputFile, recordLine)) return; // Read a whole line for a record
+    __attribute__((target("avx2"))) static int findAvx2(const char *keys, int n, int64_t key)
+    {
+        __m256i needle = _mm256_set1_epi64x(key);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i * sizeof(int64_t)));
+            int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(chunk, needle)));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        int rest = findScalar<int64_t>(keys + i * sizeof(int64_t), n - i, key);
+        return rest == -1 ? -1 : i + rest;
+    }
 
-        stringstream ss(recordLine);
-        string field;
-        vector<string> fields;
+    __attribute__((target("sse4.1"))) static int findSse4(const char *keys, int n, int32_t key)
+    {
+        __m128i needle = _mm_set1_epi32(key);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i * sizeof(int32_t)));
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(chunk, needle)));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        int rest = findScalar<int32_t>(keys + i * sizeof(int32_t), n - i, key);
+        return rest == -1 ? -1 : i + rest;
+    }
 
-        while (getline(ss, field, ',')) {
-            fields.push_back(field);
+    __attribute__((target("sse4.1"))) static int findSse4(const char *keys, int n, int64_t key)
+    {
+        __m128i needle = _mm_set1_epi64x(key);
+        int i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i * sizeof(int64_t)));
+            int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(chunk, needle)));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
         }
+        int rest = findScalar<int64_t>(keys + i * sizeof(int64_t), n - i, key);
+        return rest == -1 ? -1 : i + rest;
+    }
+#endif
 
-        if (fields.size() >= 4) { // Ensure there are enough fields
-            records.push_back(Record(fields));
+    template <typename T>
+    static int findKey(const char *keys, int n, T key)
+    {
+#if KEYPROBE_X86
+        static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+        static const bool hasSse4 = __builtin_cpu_supports("sse4.1");
+        if (hasAvx2)
+            return findAvx2(keys, n, key);
+        if (hasSse4)
+            return findSse4(keys, n, key);
+#endif
+        return findScalar<T>(keys, n, key);
+    }
+
+public:
+    // Returns the slot holding key, or -1 if the key is not in the array
+    static int find(const char *keys, int n, int64_t key, int keyWidth)
+    {
+        if (keyWidth == sizeof(int32_t))
+        {
+            // A key that does not fit in 32 bits cannot be stored in a 32-bit array
+            if (key != (int32_t)key)
+                return -1;
+            return findKey<int32_t>(keys, n, (int32_t)key);
         }
+        return findKey<int64_t>(keys, n, key);
     }
 };
 
-class LinearHashIndex
+// Page layout:
+//   [overflowPtrIdx:int64][checksum:uint32][numRecords:uint16][payloadStart:uint16]
+//   [keys:int32 or int64 x numRecords][payload offsets:uint16 x numRecords]
+//   ... free space ...
+//   [payloads, growing down from the end of the page]
+// The checksum is the CRC-32C of everything after it. The overflow pointer
+// is left out because it is updated in place when the chain grows.
+class Block
 {
+public:
+    static const int PAGE_SIZE = 4096;
+    static const int HEADER_SIZE = 16;
+    static const int CHECKSUM_OFFSET = 8;
+    static const int CHECKED_OFFSET = 12; // Start of the bytes the checksum covers
 
 private:
-    const int PAGE_SIZE = 4096;
+    char ownPage[PAGE_SIZE];
 
-    vector<int> pageDirectory;
-    int numBlocks;
+    // Either ownPage or a page of a read-only mapping of the index file
+    char *page;
 
-    int numBuckets;
-    int i;
-    int numRecords;   // Records in index
-    int nextFreePage; // Next page to write to
-    string fName;     // Name of output index file
+    char *keyArray()
+    {
+        return page + HEADER_SIZE;
+    }
 
-    int numOverflowBlocks;
+    char *offsetArray()
+    {
+        return page + HEADER_SIZE + numRecords * format.keyWidth;
+    }
 
-    int currentTotalSize;
+    int freeSpace()
+    {
+        return payloadStart - (HEADER_SIZE + numRecords * (format.keyWidth + (int)sizeof(uint16_t)));
+    }
 
-    Record getRecord(fstream &recordIn)
+    void writeHeader()
     {
-        string line, word;
-        vector<std::string> fields;
+        uint16_t count = numRecords;
+        uint16_t start = payloadStart;
+        memcpy(page, &overflowPtrIdx, sizeof(overflowPtrIdx));
+        memcpy(page + 12, &count, sizeof(count));
+        memcpy(page + 14, &start, sizeof(start));
+    }
 
-        if (!getline(recordIn, line, '\n'))
+    uint32_t computeChecksum() const
+    {
+        return Crc32c::compute(page + CHECKED_OFFSET, PAGE_SIZE - CHECKED_OFFSET);
+    }
+
+public:
+    int blockSize;
+    int64_t overflowPtrIdx;
+    int numRecords;
+    int64_t blockIdx;
+    int payloadStart;
+    IndexOptions format;
+
+    // What the page of a new block starts out as
+    enum Contents
+    {
+        EMPTY, // An empty page, ready for records
+        UNREAD // Undefined; the caller reads or attaches a page before use
+    };
+
+    // Lookups pass UNREAD to skip clearing a page that is about to be
+    // overwritten or replaced by a mapped one
+    Block(int64_t physIdx, const IndexOptions &indexFormat, Contents contents = EMPTY)
+    {
+        blockIdx = physIdx;
+        format = indexFormat;
+        if (contents == EMPTY)
         {
-            fields.push_back("-1");
-            fields.push_back("-1");
-            fields.push_back("-1");
-            fields.push_back("-1");
-            return Record(fields);
+            initEmpty();
         }
         else
         {
-            stringstream s(line);
+            page = ownPage;
+            overflowPtrIdx = -1;
+            numRecords = 0;
+            payloadStart = PAGE_SIZE;
+            blockSize = HEADER_SIZE;
+        }
+    }
 
-            getline(s, word, ',');
-            fields.push_back(word);
-            getline(s, word, ',');
-            fields.push_back(word);
-            getline(s, word, ',');
-            fields.push_back(word);
-            getline(s, word, ',');
-            fields.push_back(word);
+    Block(const Block &other)
+    {
+        *this = other;
+    }
 
-            return Record(fields);
+    Block &operator=(const Block &other)
+    {
+        if (other.page == other.ownPage)
+        {
+            memcpy(ownPage, other.ownPage, PAGE_SIZE);
+            page = ownPage;
         }
+        else
+        {
+            page = other.page;
+        }
+        blockSize = other.blockSize;
+        overflowPtrIdx = other.overflowPtrIdx;
+        numRecords = other.numRecords;
+        blockIdx = other.blockIdx;
+        payloadStart = other.payloadStart;
+        format = other.format;
+        return *this;
     }
 
-    int hash(int id)
+    // Reset to an empty page with no overflow block
+    void initEmpty()
     {
-        return (id % (int)pow(2, 16));
+        page = ownPage;
+        memset(page, 0, PAGE_SIZE);
+        overflowPtrIdx = -1;
+        numRecords = 0;
+        payloadStart = PAGE_SIZE;
+        blockSize = HEADER_SIZE;
+        writeHeader();
     }
 
-    int getLastIthBits(int hashVal, int i)
+    // Raw page bytes, for callers that fill the page asynchronously
+    char *data()
     {
-        return hashVal & ((1 << i) - 1);
+        page = ownPage;
+        return page;
     }
 
-    int initBucket(fstream &indexFile)
+    void readBlock(FileIO &inputFile)
     {
+        page = ownPage;
+        inputFile.read(blockIdx * PAGE_SIZE, page, PAGE_SIZE);
+        loadHeader();
+    }
 
-        int overflowIdx = -1;
-        int defaultNumRecords = 0;
+    // Use a page of a read-only mapping in place instead of copying it. The
+    // block must not be modified while attached.
+    void attach(const char *mappedPage)
+    {
+        page = const_cast<char *>(mappedPage);
+        loadHeader();
+    }
 
-        indexFile.seekp(nextFreePage * PAGE_SIZE);
+    // Decode the header fields after the page bytes have been read
+    void loadHeader()
+    {
+        uint16_t count;
+        uint16_t start;
+        memcpy(&overflowPtrIdx, page, sizeof(overflowPtrIdx));
+        memcpy(&count, page + 12, sizeof(count));
+        memcpy(&start, page + 14, sizeof(start));
+
+        numRecords = count;
+        payloadStart = start;
+        blockSize = PAGE_SIZE - freeSpace();
+    }
 
-        indexFile.write(reinterpret_cast<const char *>(&overflowIdx), sizeof(overflowIdx));
-        indexFile.write(reinterpret_cast<const char *>(&defaultNumRecords), sizeof(defaultNumRecords));
+    void writeBlock(FileIO &outputFile)
+    {
+        writeHeader();
+        uint32_t checksum = computeChecksum();
+        memcpy(page + CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+        outputFile.write(blockIdx * PAGE_SIZE, page, PAGE_SIZE);
+    }
 
-        pageDirectory.push_back(nextFreePage++);
-        numBlocks++;
-        numBuckets++;
+    // Whether the page bytes match the checksum they were written with. A
+    // torn write or a page overwritten with anything else fails.
+    bool checksumMatches() const
+    {
+        uint32_t stored;
+        memcpy(&stored, page + CHECKSUM_OFFSET, sizeof(stored));
+        return stored == computeChecksum();
+    }
 
-        // Update current total size
-        currentTotalSize += sizeof(overflowIdx) + sizeof(defaultNumRecords);
+    // Slot of the record with the given id, or -1 if it is not in this page
+    int findSlot(int64_t id)
+    {
+        return KeyProbe::find(keyArray(), numRecords, id, format.keyWidth);
+    }
 
-        return pageDirectory.size() - 1;
+    int64_t getKey(int slot)
+    {
+        if (format.keyWidth == sizeof(int32_t))
+        {
+            int32_t key;
+            memcpy(&key, keyArray() + slot * sizeof(int32_t), sizeof(key));
+            return key;
+        }
+        int64_t key;
+        memcpy(&key, keyArray() + slot * sizeof(int64_t), sizeof(key));
+        return key;
     }
 
-    int initOverflowBlock(int parentBlockIdx, fstream &indexFile)
+    Record getRecord(int slot)
     {
+        Record record;
+        getRecord(slot, record);
+        return record;
+    }
 
-        int overflowIdx = -1;
-        int defaultNumRecords = 0;
+    // Decode a record into an existing one, reusing its string buffers. Only
+    // the fields in the mask are decoded.
+    void getRecord(int slot, Record &record, uint32_t fields = Record::ALL_FIELDS)
+    {
+        uint16_t offset;
+        memcpy(&offset, offsetArray() + slot * sizeof(uint16_t), sizeof(offset));
+        record.readRecord(getKey(slot), page + offset, format, fields);
+    }
 
-        // Get index of current overflow block
-        int currIdx = nextFreePage++;
+    // Append a record to the page. The caller checks that it fits first.
+    void addRecord(Record &record)
+    {
+        // Shift the offset array to make room for the new key
+        char *offsets = offsetArray();
+        memmove(offsets + format.keyWidth, offsets, numRecords * sizeof(uint16_t));
 
-        indexFile.seekp(currIdx * PAGE_SIZE);
+        if (format.keyWidth == sizeof(int32_t))
+        {
+            int32_t key = record.id;
+            memcpy(keyArray() + numRecords * sizeof(int32_t), &key, sizeof(key));
+        }
+        else
+        {
+            memcpy(keyArray() + numRecords * sizeof(int64_t), &record.id, sizeof(record.id));
+        }
 
-        indexFile.write(reinterpret_cast<const char *>(&overflowIdx), sizeof(overflowIdx));
-        indexFile.write(reinterpret_cast<const char *>(&defaultNumRecords), sizeof(defaultNumRecords));
+        payloadStart -= record.getPayloadSize(format);
+        record.writeRecord(page + payloadStart, format);
 
-        indexFile.seekp(parentBlockIdx * PAGE_SIZE);
-        indexFile.write(reinterpret_cast<const char *>(&currIdx), sizeof(currIdx));
+        uint16_t offset = payloadStart;
+        numRecords++;
+        memcpy(offsetArray() + (numRecords - 1) * sizeof(uint16_t), &offset, sizeof(offset));
 
-        currentTotalSize += sizeof(overflowIdx) + sizeof(defaultNumRecords);
+        blockSize += record.getSize(format);
+        writeHeader();
+    }
+};
 
-        // Update number of overflow blocks and blocks
-        numBlocks++;
-        numOverflowBlocks++;
+// Recycles page buffers for the build and split paths. Borrowed blocks keep
+// whatever page they last held, so callers either read a page into them or
+// reset them with initEmpty; nothing is freed until the pool is destroyed.
+class BlockPool
+{
+private:
+    vector<Block *> freeBlocks;
 
-        return currIdx;
+    void release(Block *block)
+    {
+        freeBlocks.push_back(block);
     }
 
-    int initEmptyBlock(fstream &indexFile)
+public:
+    // A borrowed block, handed back to the pool when it goes out of scope
+    class Handle
     {
+    private:
+        BlockPool *pool;
+        Block *block;
 
-        int overflowIdx = -1;
-        int defaultNumRecords = 0;
+    public:
+        Handle(BlockPool *owner, Block *borrowed)
+        {
+            pool = owner;
+            block = borrowed;
+        }
 
-        // Get index for current block
-        int currIdx = nextFreePage++;
+        Handle(Handle &&other)
+        {
+            pool = other.pool;
+            block = other.block;
+            other.block = nullptr;
+        }
 
-        indexFile.seekp(currIdx * PAGE_SIZE);
+        ~Handle()
+        {
+            if (block != nullptr)
+                pool->release(block);
+        }
 
-        indexFile.write(reinterpret_cast<const char *>(&overflowIdx), sizeof(overflowIdx));
-        indexFile.write(reinterpret_cast<const char *>(&defaultNumRecords), sizeof(defaultNumRecords));
+        Handle(const Handle &) = delete;
+        Handle &operator=(const Handle &) = delete;
 
-        // Update current total size
-        currentTotalSize += sizeof(overflowIdx) + sizeof(defaultNumRecords);
+        Block &operator*()
+        {
+            return *block;
+        }
 
-        numBlocks++;
+        Block *operator->()
+        {
+            return block;
+        }
+    };
 
-        return currIdx;
+    BlockPool() {}
+
+    ~BlockPool()
+    {
+        for (Block *block : freeBlocks)
+            delete block;
+    }
+
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+
+    Handle acquire(int64_t physIdx, const IndexOptions &format)
+    {
+        if (freeBlocks.empty())
+            return Handle(this, new Block(physIdx, format));
+
+        Block *block = freeBlocks.back();
+        freeBlocks.pop_back();
+        block->blockIdx = physIdx;
+        block->format = format;
+        return Handle(this, block);
     }
+};
+
+// Allocator for memory aligned to Alignment bytes. C++14's operator new only
+// guarantees alignment suitable for the fundamental types.
+template <typename T, size_t Alignment>
+struct AlignedAllocator
+{
+    typedef T value_type;
 
-    // Write a record to a given position in the index file and update record count
-    void writeRecordAndUpdateCountInPosition(Record &record, int pos, double totalBlocksize, int newNumRecords, fstream &indexFile)
+    template <typename U>
+    struct rebind
     {
-        indexFile.seekp(totalBlocksize);
-        record.writeRecord(indexFile);
-        indexFile.seekp(pos + sizeof(int));
-        indexFile.write(reinterpret_cast<const char *>(&newNumRecords), sizeof(newNumRecords));
+        typedef AlignedAllocator<U, Alignment> other;
+    };
 
-        // Update current total size
-        currentTotalSize += record.getSize();
+    AlignedAllocator()
+    {
     }
 
-    // Get overflow index and write record to overflow block
-    void writeRecordToOverflowBlock(Record &record, int baseBlockPgIdx, fstream &indexFile)
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &)
     {
-        int overflowIdx = initOverflowBlock(baseBlockPgIdx, indexFile);
-        int pos = (overflowIdx * PAGE_SIZE);
-        writeRecordAndUpdateCountInPosition(record, pos, pos + sizeof(int) + sizeof(int), 1, indexFile);
     }
 
-    void writeRecordToIndexFile(Record record, int baseBlockPgIdx, fstream &indexFile)
+    T *allocate(size_t n)
     {
-        bool hasWrittenRecord = false;
-        while (!hasWrittenRecord)
-        {
-            Block currBlock(baseBlockPgIdx);
-            currBlock.readBlock(indexFile);
-            if (currBlock.blockSize + record.getSize() <= PAGE_SIZE)
-            {
-                int pos = (baseBlockPgIdx * PAGE_SIZE);
-                double totalBlocksize = pos + currBlock.blockSize;
-                writeRecordAndUpdateCountInPosition(record, pos, totalBlocksize, currBlock.numRecords + 1, indexFile);
-                hasWrittenRecord = true;
-            }
-            else if (currBlock.overflowPtrIdx != -1)
-            {
-                baseBlockPgIdx = currBlock.overflowPtrIdx;
-            }
-            else
-            {
-                writeRecordToOverflowBlock(record, baseBlockPgIdx, indexFile);
-                hasWrittenRecord = true;
-            }
-        }
+        void *mem = nullptr;
+        if (posix_memalign(&mem, Alignment, n * sizeof(T)) != 0)
+            throw bad_alloc();
+        return static_cast<T *>(mem);
     }
 
-    // Initialize buckets if no records are present
-    void initBucketsIfNecessary(fstream &indexFile)
+    void deallocate(T *mem, size_t)
     {
-        if (numRecords == 0)
-        {
-            for (int i = 0; i < 2; i++)
-            {
-                initBucket(indexFile);
-            }
-            i = 1;
-        }
+        free(mem);
     }
 
-    // Write a record to the index file and update record count
-    void writeRecordAndUpdateCount(Record &record, int pgIdx, fstream &indexFile)
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const
     {
-        writeRecordToIndexFile(record, pgIdx, indexFile);
-        numRecords++;
+        return true;
     }
 
-    // Handle situation if bucket overflows
-    void handleBucketOverflow(fstream &indexFile)
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment> &) const
     {
-        double avgCapacityPerBucket = (double)currentTotalSize / numBuckets;
-        double pageSizeMul = 0.7 * PAGE_SIZE;
+        return false;
+    }
+};
 
-        if (avgCapacityPerBucket > pageSizeMul)
-        {
-            int newBucketIdx = initBucket(indexFile);
+// Array shared between the writer and the snapshots lookups read from.
+// Entries live in fixed-size chunks, reached through tables of chunk
+// pointers, so copying the array only copies the pointer to the top level.
+// The writer copies the top level, table and chunk on the way to an entry
+// before changing it while any snapshot still holds them, so a publish costs
+// the same however large the array grows.
+template <typename T, typename Allocator = allocator<T>>
+class ChunkedArray
+{
+private:
+    static const int64_t CHUNK_SIZE = 512;
+    static const int64_t TABLE_SIZE = 32; // Chunks per table
+    typedef vector<T, Allocator> Chunk;
+    typedef vector<shared_ptr<Chunk>> Table;
+    typedef vector<shared_ptr<Table>> Tables;
+
+    shared_ptr<Tables> tables;
+    int64_t length;
+
+    // The node itself, copied first if a snapshot also holds it. Snapshots
+    // only ever drop their references, so a node the writer alone holds
+    // stays its own.
+    template <typename Node>
+    static Node &own(shared_ptr<Node> &node)
+    {
+        if (node.use_count() > 1)
+            node = make_shared<Node>(*node);
+        return *node;
+    }
 
-            int digitsToAddressNewBucket = (int)ceil(log2(numBuckets));
+public:
+    ChunkedArray()
+    {
+        clear();
+    }
 
-            int bucketToTransferFromIdx = newBucketIdx;
-            bucketToTransferFromIdx &= ~(1 << (digitsToAddressNewBucket - 1));
+    int64_t size() const
+    {
+        return length;
+    }
 
-            int bucketToTransferFromPageIdx = pageDirectory[bucketToTransferFromIdx];
+    const T &operator[](int64_t idx) const
+    {
+        const Table &table = *(*tables)[idx / (CHUNK_SIZE * TABLE_SIZE)];
+        return (*table[idx / CHUNK_SIZE % TABLE_SIZE])[idx % CHUNK_SIZE];
+    }
 
-            int newOldBucketPageIdx = initEmptyBlock(indexFile);
+    // Entry to change in place. Only the writer calls this.
+    T &mutableAt(int64_t idx)
+    {
+        Table &table = own(own(tables)[idx / (CHUNK_SIZE * TABLE_SIZE)]);
+        return own(table[idx / CHUNK_SIZE % TABLE_SIZE])[idx % CHUNK_SIZE];
+    }
 
-            while (bucketToTransferFromPageIdx != -1)
+    // Grow to newSize entries, setting the new ones to fill
+    void resize(int64_t newSize, const T &fill = T())
+    {
+        for (; length < newSize; length++)
+        {
+            if (length % CHUNK_SIZE == 0)
             {
+                Tables &owned = own(tables);
+                if (length % (CHUNK_SIZE * TABLE_SIZE) == 0)
+                    owned.push_back(make_shared<Table>());
+                own(owned.back()).push_back(make_shared<Chunk>((size_t)CHUNK_SIZE));
+            }
+            mutableAt(length) = fill;
+        }
+    }
 
-                Block oldBlock(bucketToTransferFromPageIdx);
-                oldBlock.readBlock(indexFile);
-
-                indexFile.seekp(oldBlock.blockIdx * PAGE_SIZE);
-                indexFile << string(PAGE_SIZE, '*');
+    void push_back(const T &value)
+    {
+        resize(length + 1, value);
+    }
 
-                numBlocks--;
-                numOverflowBlocks--;
+    void clear()
+    {
+        tables = make_shared<Tables>();
+        length = 0;
+    }
+};
 
-                currentTotalSize -= oldBlock.blockSize;
-                numRecords -= oldBlock.numRecords;
+// One bit per page that any number of threads may test and set at once.
+// Bits live in fixed chunks that are allocated on first use and never move;
+// pages past the last chunk read as unset.
+class PageBits
+{
+private:
+    static const int64_t CHUNK_WORDS = 1024; // 64K pages per chunk
+    static const int64_t MAX_CHUNKS = 4096;
 
-                for (int i = 0; i < oldBlock.numRecords; i++)
-                {
+    unique_ptr<atomic<atomic<uint64_t> *>[]> chunks;
 
-                    if (getLastIthBits(hash(oldBlock.records[i].id), digitsToAddressNewBucket) != newBucketIdx)
-                    {
-                        int tempNewOldBlockPgIdx = newOldBucketPageIdx;
-                        writeRecordToIndexFile(oldBlock.records[i], tempNewOldBlockPgIdx, indexFile);
-                    }
-                    else
-                    {
-                        int newBucketBlockPgIdx = pageDirectory[newBucketIdx];
-                        writeRecordToIndexFile(oldBlock.records[i], newBucketBlockPgIdx, indexFile);
-                    }
-                    numRecords++;
-                }
-                bucketToTransferFromPageIdx = oldBlock.overflowPtrIdx;
-            }
+public:
+    PageBits() : chunks(new atomic<atomic<uint64_t> *>[MAX_CHUNKS])
+    {
+        for (int64_t c = 0; c < MAX_CHUNKS; c++)
+            chunks[c] = nullptr;
+    }
 
-            numOverflowBlocks++;
+    ~PageBits()
+    {
+        clear();
+    }
 
-            pageDirectory[bucketToTransferFromIdx] = newOldBucketPageIdx;
+    PageBits(const PageBits &) = delete;
+    PageBits &operator=(const PageBits &) = delete;
 
-            i = digitsToAddressNewBucket;
-        }
+    bool test(int64_t pgIdx) const
+    {
+        int64_t word = pgIdx / 64;
+        if (word / CHUNK_WORDS >= MAX_CHUNKS)
+            return false;
+        atomic<uint64_t> *chunk = chunks[word / CHUNK_WORDS].load(memory_order_acquire);
+        return chunk != nullptr &&
+               (chunk[word % CHUNK_WORDS].load(memory_order_relaxed) & ((uint64_t)1 << (pgIdx % 64))) != 0;
     }
 
-    void insertRecord(Record record, fstream &indexFile)
+    void set(int64_t pgIdx)
     {
-        initBucketsIfNecessary(indexFile);
-        int bucketIdx = getLastIthBits(hash(record.id), i);
-        if (bucketIdx >= numBuckets)
+        int64_t word = pgIdx / 64;
+        if (word / CHUNK_WORDS >= MAX_CHUNKS)
+            return;
+
+        atomic<atomic<uint64_t> *> &slot = chunks[word / CHUNK_WORDS];
+        atomic<uint64_t> *chunk = slot.load(memory_order_acquire);
+        if (chunk == nullptr)
         {
-            bucketIdx &= ~(1 << (i - 1));
+            atomic<uint64_t> *fresh = new atomic<uint64_t>[CHUNK_WORDS];
+            for (int64_t w = 0; w < CHUNK_WORDS; w++)
+                fresh[w] = 0;
+            if (slot.compare_exchange_strong(chunk, fresh, memory_order_acq_rel))
+                chunk = fresh;
+            else
+                delete[] fresh;
         }
-        int pgIdx = pageDirectory[bucketIdx];
-        writeRecordAndUpdateCount(record, pgIdx, indexFile);
-        handleBucketOverflow(indexFile);
+        chunk[word % CHUNK_WORDS].fetch_or((uint64_t)1 << (pgIdx % 64), memory_order_relaxed);
+    }
+
+    // Unset one bit. No other thread may be testing it.
+    void reset(int64_t pgIdx)
+    {
+        int64_t word = pgIdx / 64;
+        if (word / CHUNK_WORDS >= MAX_CHUNKS)
+            return;
+        atomic<uint64_t> *chunk = chunks[word / CHUNK_WORDS].load(memory_order_acquire);
+        if (chunk != nullptr)
+            chunk[word % CHUNK_WORDS].fetch_and(~((uint64_t)1 << (pgIdx % 64)), memory_order_relaxed);
+    }
+
+    // Unset every bit. No other thread may be using the set.
+    void clear()
+    {
+        for (int64_t c = 0; c < MAX_CHUNKS; c++)
+        {
+            delete[] chunks[c].load();
+            chunks[c] = nullptr;
+        }
+    }
+};
+
+// Chain link and key filter of one page: the part of the free-space map
+// lookups read. The filter is a 256-bit Bloom filter of the page's keys.
+struct PageLinks
+{
+    static const int FILTER_WORDS = 4;
+
+    int64_t nextPage;
+    uint64_t keyFilter[FILTER_WORDS];
+
+    // Two filter bits per key, from a different hash than the bucket
+    // directory's filter so the two reject different ids
+    static void filterBits(int64_t id, int bits[2])
+    {
+        uint64_t h = (uint64_t)id * 0xC2B2AE3D27D4EB4FULL;
+        bits[0] = h >> 56;
+        bits[1] = (h >> 48) & 0xFF;
+    }
+
+    // Whether id may be on the page; false means it is not
+    bool mayContain(int64_t id) const
+    {
+        int bits[2];
+        filterBits(id, bits);
+        return (keyFilter[bits[0] / 64] & ((uint64_t)1 << (bits[0] % 64))) != 0 &&
+               (keyFilter[bits[1] / 64] & ((uint64_t)1 << (bits[1] % 64))) != 0;
+    }
+
+    void addKey(int64_t id)
+    {
+        int bits[2];
+        filterBits(id, bits);
+        keyFilter[bits[0] / 64] |= (uint64_t)1 << (bits[0] % 64);
+        keyFilter[bits[1] / 64] |= (uint64_t)1 << (bits[1] % 64);
+    }
+};
+
+// Free bytes of every page, kept in memory so an insert can pick the page
+// it will write to without reading and parsing the chain. It also mirrors
+// each page's overflow pointer so chains can be walked without reads, and
+// keeps a Bloom filter of each page's keys so a lookup only reads the pages
+// that may hold its id. Persisted to a sidecar file as
+// [magic:uint32][numPages:int64] followed by
+// [freeBytes:uint16][overflowPtrIdx:int64][keyFilter:32 bytes] per page; only
+// entries changed since the last persist are rewritten.
+class FreeSpaceMap
+{
+public:
+    typedef ChunkedArray<PageLinks> Links;
+
+private:
+    static const uint32_t MAGIC = 0x4D53464C; // "LFSM"
+    static const int FILE_HEADER_SIZE = sizeof(uint32_t) + sizeof(int64_t);
+    static const int FILTER_SIZE = PageLinks::FILTER_WORDS * sizeof(uint64_t);
+    static const int ENTRY_SIZE = sizeof(uint16_t) + sizeof(int64_t) + FILTER_SIZE;
+
+    vector<uint16_t> freeBytes;
+    Links links;
+    vector<int64_t> dirtyPages;
+    vector<bool> isDirty;
+
+    void markDirty(int64_t pgIdx)
+    {
+        if (!isDirty[pgIdx])
+        {
+            isDirty[pgIdx] = true;
+            dirtyPages.push_back(pgIdx);
+        }
+    }
+
+    static PageLinks emptyLinks()
+    {
+        PageLinks empty = PageLinks();
+        empty.nextPage = -1;
+        return empty;
+    }
+
+    void ensurePage(int64_t pgIdx)
+    {
+        if (pgIdx >= (int64_t)freeBytes.size())
+        {
+            freeBytes.resize(pgIdx + 1, 0);
+            links.resize(pgIdx + 1, emptyLinks());
+            isDirty.resize(pgIdx + 1, false);
+        }
+    }
+
+public:
+    void clear()
+    {
+        freeBytes.clear();
+        links.clear();
+        dirtyPages.clear();
+        isDirty.clear();
+    }
+
+    // Chain links and key filters as they are now, for a snapshot
+    const Links &pageLinks() const
+    {
+        return links;
+    }
+
+    int getFree(int64_t pgIdx) const
+    {
+        return freeBytes[pgIdx];
+    }
+
+    int64_t getNext(int64_t pgIdx) const
+    {
+        return links[pgIdx].nextPage;
+    }
+
+    void setFree(int64_t pgIdx, int bytes)
+    {
+        ensurePage(pgIdx);
+        freeBytes[pgIdx] = bytes;
+        markDirty(pgIdx);
+    }
+
+    void setNext(int64_t pgIdx, int64_t next)
+    {
+        ensurePage(pgIdx);
+        links.mutableAt(pgIdx).nextPage = next;
+        markDirty(pgIdx);
+    }
+
+    // Whether id may be on the page; false means it is not
+    bool mayContain(int64_t pgIdx, int64_t id) const
+    {
+        return links[pgIdx].mayContain(id);
+    }
+
+    // Record that id was written to the page
+    void addKey(int64_t pgIdx, int64_t id)
+    {
+        ensurePage(pgIdx);
+        links.mutableAt(pgIdx).addKey(id);
+        markDirty(pgIdx);
+    }
+
+    // Forget the keys of a page that has been emptied
+    void clearKeys(int64_t pgIdx)
+    {
+        ensurePage(pgIdx);
+        PageLinks &entry = links.mutableAt(pgIdx);
+        memset(entry.keyFilter, 0, sizeof(entry.keyFilter));
+        markDirty(pgIdx);
+    }
+
+    // Give page to the free bytes and key filter of page from, as for a copy
+    // of it that ends its chain
+    void copyPage(int64_t from, int64_t to)
+    {
+        ensurePage(max(from, to));
+        freeBytes[to] = freeBytes[from];
+        PageLinks copy = links[from];
+        copy.nextPage = -1;
+        links.mutableAt(to) = copy;
+        markDirty(to);
+    }
+
+    // Write the entries that changed since the last persist
+    void persist(FileIO &mapFile)
+    {
+        char header[FILE_HEADER_SIZE];
+        int64_t numPages = freeBytes.size();
+        memcpy(header, &MAGIC, sizeof(MAGIC));
+        memcpy(header + sizeof(MAGIC), &numPages, sizeof(numPages));
+        mapFile.write(0, header, sizeof(header));
+
+        sort(dirtyPages.begin(), dirtyPages.end());
+        char entry[ENTRY_SIZE];
+        for (int64_t pgIdx : dirtyPages)
+        {
+            memcpy(entry, &freeBytes[pgIdx], sizeof(uint16_t));
+            memcpy(entry + sizeof(uint16_t), &links[pgIdx].nextPage, sizeof(int64_t));
+            memcpy(entry + sizeof(uint16_t) + sizeof(int64_t), links[pgIdx].keyFilter, FILTER_SIZE);
+            mapFile.write(FILE_HEADER_SIZE + pgIdx * ENTRY_SIZE, entry, ENTRY_SIZE);
+            isDirty[pgIdx] = false;
+        }
+        dirtyPages.clear();
+    }
+
+    // Returns false if the file does not hold a free-space map
+    bool load(FileIO &mapFile)
+    {
+        char header[FILE_HEADER_SIZE];
+        mapFile.read(0, header, sizeof(header));
+
+        uint32_t magic;
+        int64_t numPages;
+        memcpy(&magic, header, sizeof(magic));
+        memcpy(&numPages, header + sizeof(magic), sizeof(numPages));
+        if (magic != MAGIC || numPages < 0)
+            return false;
+
+        vector<char> entries(numPages * ENTRY_SIZE);
+        mapFile.read(FILE_HEADER_SIZE, entries.data(), entries.size());
+
+        clear();
+        freeBytes.resize(numPages);
+        isDirty.resize(numPages, false);
+        for (int64_t pgIdx = 0; pgIdx < numPages; pgIdx++)
+        {
+            const char *entry = &entries[pgIdx * ENTRY_SIZE];
+            PageLinks pageLinks;
+            memcpy(&freeBytes[pgIdx], entry, sizeof(uint16_t));
+            memcpy(&pageLinks.nextPage, entry + sizeof(uint16_t), sizeof(int64_t));
+            memcpy(pageLinks.keyFilter, entry + sizeof(uint16_t) + sizeof(int64_t), FILTER_SIZE);
+            links.push_back(pageLinks);
+        }
+        return true;
+    }
+};
+
+// One cache line per bucket: the first and last page and length of its chain,
+// its record count and a small Bloom filter of its keys. The tail pointer lets
+// an insert append to the end of a chain without walking it; the filter lets
+// most lookups for absent ids finish without reading a page.
+struct alignas(64) BucketEntry
+{
+    static const int FILTER_WORDS = 5;
+    static const int FILTER_BITS = FILTER_WORDS * 64;
+
+    int64_t headPage;
+    int64_t tailPage;
+    int32_t numPages;
+    int32_t numRecords;
+    uint64_t keyFilter[FILTER_WORDS];
+
+    // Three filter bits per key, from a multiplicative hash so they do not
+    // depend on the low bits that chose the bucket
+    static void filterBits(int64_t id, int bits[3])
+    {
+        uint64_t h = (uint64_t)id * 0x9E3779B97F4A7C15ULL;
+        bits[0] = (h >> 43) % FILTER_BITS;
+        bits[1] = ((h >> 22) & 0x1FFFFF) % FILTER_BITS;
+        bits[2] = (h & 0x3FFFFF) % FILTER_BITS;
+    }
+
+    // Whether id may be in the bucket's chain; false means it is not
+    bool mayContain(int64_t id) const
+    {
+        if (numRecords == 0)
+            return false;
+
+        int bits[3];
+        filterBits(id, bits);
+        for (int b : bits)
+        {
+            if ((keyFilter[b / 64] & ((uint64_t)1 << (b % 64))) == 0)
+                return false;
+        }
+        return true;
+    }
+
+    void addKey(int64_t id)
+    {
+        int bits[3];
+        filterBits(id, bits);
+        for (int b : bits)
+            keyFilter[b / 64] |= (uint64_t)1 << (b % 64);
+        numRecords++;
+    }
+};
+
+// Directory of every bucket's BucketEntry. Persisted to a sidecar file as
+// [magic:uint32][numBuckets:int64] followed by the 64-byte entries; only
+// entries changed since the last persist are rewritten.
+class BucketDirectory
+{
+public:
+    typedef ChunkedArray<BucketEntry, AlignedAllocator<BucketEntry, 64>> Entries;
+
+private:
+    static const uint32_t MAGIC = 0x5249444C; // "LDIR"
+    static const int FILE_HEADER_SIZE = sizeof(uint32_t) + sizeof(int64_t);
+
+    Entries entries;
+    vector<int64_t> dirtyBuckets;
+    vector<bool> isDirty;
+
+    void markDirty(int64_t bucketIdx)
+    {
+        if (!isDirty[bucketIdx])
+        {
+            isDirty[bucketIdx] = true;
+            dirtyBuckets.push_back(bucketIdx);
+        }
+    }
+
+public:
+    void clear()
+    {
+        entries.clear();
+        dirtyBuckets.clear();
+        isDirty.clear();
+    }
+
+    // Entries as they are now, for a snapshot
+    const Entries &bucketEntries() const
+    {
+        return entries;
+    }
+
+    int64_t size() const
+    {
+        return entries.size();
+    }
+
+    int64_t headPage(int64_t bucketIdx) const
+    {
+        return entries[bucketIdx].headPage;
+    }
+
+    int64_t tailPage(int64_t bucketIdx) const
+    {
+        return entries[bucketIdx].tailPage;
+    }
+
+    int64_t chainLength(int64_t bucketIdx) const
+    {
+        return entries[bucketIdx].numPages;
+    }
+
+    int64_t recordCount(int64_t bucketIdx) const
+    {
+        return entries[bucketIdx].numRecords;
+    }
+
+    // Whether id may be in the bucket's chain; false means it is not
+    bool mayContain(int64_t bucketIdx, int64_t id) const
+    {
+        return entries[bucketIdx].mayContain(id);
+    }
+
+    // Record that id was written to the bucket's chain
+    void addKey(int64_t bucketIdx, int64_t id)
+    {
+        entries.mutableAt(bucketIdx).addKey(id);
+        markDirty(bucketIdx);
+    }
+
+    // Add a bucket whose chain is the single page pgIdx; returns its index
+    int64_t addBucket(int64_t pgIdx)
+    {
+        BucketEntry entry = BucketEntry();
+        entry.headPage = pgIdx;
+        entry.tailPage = pgIdx;
+        entry.numPages = 1;
+        entries.push_back(entry);
+        isDirty.push_back(false);
+        markDirty(entries.size() - 1);
+        return entries.size() - 1;
+    }
+
+    // Point a bucket at a new single-page chain
+    void resetBucket(int64_t bucketIdx, int64_t pgIdx)
+    {
+        BucketEntry &entry = entries.mutableAt(bucketIdx);
+        entry = BucketEntry();
+        entry.headPage = pgIdx;
+        entry.tailPage = pgIdx;
+        entry.numPages = 1;
+        markDirty(bucketIdx);
+    }
+
+    // Record a page linked after the current tail
+    void appendPage(int64_t bucketIdx, int64_t pgIdx)
+    {
+        BucketEntry &entry = entries.mutableAt(bucketIdx);
+        entry.tailPage = pgIdx;
+        entry.numPages++;
+        markDirty(bucketIdx);
+    }
+
+    // Record that the tail page was replaced by a copy at pgIdx
+    void replaceTailPage(int64_t bucketIdx, int64_t pgIdx)
+    {
+        BucketEntry &entry = entries.mutableAt(bucketIdx);
+        if (entry.headPage == entry.tailPage)
+            entry.headPage = pgIdx;
+        entry.tailPage = pgIdx;
+        markDirty(bucketIdx);
+    }
+
+    // Write the entries that changed since the last persist
+    void persist(FileIO &dirFile)
+    {
+        char header[FILE_HEADER_SIZE];
+        int64_t numBuckets = entries.size();
+        memcpy(header, &MAGIC, sizeof(MAGIC));
+        memcpy(header + sizeof(MAGIC), &numBuckets, sizeof(numBuckets));
+        dirFile.write(0, header, sizeof(header));
+
+        sort(dirtyBuckets.begin(), dirtyBuckets.end());
+        for (int64_t bucketIdx : dirtyBuckets)
+        {
+            dirFile.write(FILE_HEADER_SIZE + bucketIdx * sizeof(BucketEntry),
+                          reinterpret_cast<const char *>(&entries[bucketIdx]), sizeof(BucketEntry));
+            isDirty[bucketIdx] = false;
+        }
+        dirtyBuckets.clear();
+    }
+
+    // Returns false if the file does not hold a bucket directory
+    bool load(FileIO &dirFile)
+    {
+        char header[FILE_HEADER_SIZE];
+        dirFile.read(0, header, sizeof(header));
+
+        uint32_t magic;
+        int64_t numBuckets;
+        memcpy(&magic, header, sizeof(magic));
+        memcpy(&numBuckets, header + sizeof(magic), sizeof(numBuckets));
+        if (magic != MAGIC || numBuckets < 0)
+            return false;
+
+        vector<BucketEntry, AlignedAllocator<BucketEntry, 64>> saved(numBuckets);
+        dirFile.read(FILE_HEADER_SIZE, reinterpret_cast<char *>(saved.data()), numBuckets * sizeof(BucketEntry));
+
+        clear();
+        for (const BucketEntry &entry : saved)
+            entries.push_back(entry);
+        isDirty.resize(numBuckets, false);
+        return true;
+    }
+};
+
+// What a lookup needs of the index, frozen at one point in time. The writer
+// publishes a new snapshot after every change and never changes a page or
+// metadata chunk a published snapshot can reach, so a lookup that holds one
+// sees a consistent index without taking a lock.
+struct IndexSnapshot
+{
+    int level;
+    int64_t splitPointer;
+    int64_t numBuckets;
+    int64_t splitSourceBucket;
+    int64_t splitChainPage;
+    BucketDirectory::Entries buckets;
+    FreeSpaceMap::Links pages;
+    shared_ptr<MappedFile> indexMap;
+    shared_ptr<MappedFile> heapMap;
+};
+
+// Page 0 of the index file. Records the on-disk format so a reader knows how
+// wide keys and page numbers are, plus the index counters at the last flush.
+class IndexHeader
+{
+private:
+    char page[Block::PAGE_SIZE];
+    int pos;
+
+    template <typename T>
+    void put(T value)
+    {
+        memcpy(page + pos, &value, sizeof(value));
+        pos += sizeof(value);
+    }
+
+    template <typename T>
+    T get()
+    {
+        T value;
+        memcpy(&value, page + pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+
+public:
+    static const uint32_t MAGIC = 0x5849484C; // "LHIX"
+    static const uint32_t VERSION = 2;
+
+    // Bits of the flags field
+    static const uint32_t FLAG_VALUE_HEAP = 1;
+    static const uint32_t FLAG_COMPRESSED_BIO = 2;
+
+    // Bytes left in the header page for the bio dictionary
+    static const int MAX_DICTIONARY_SIZE = 3072;
+
+    // The header page ends with the CRC-32C of the rest of it
+    static const int CHECKSUM_OFFSET = Block::PAGE_SIZE - sizeof(uint32_t);
+
+    int32_t keyWidth;
+    uint32_t flags;
+    int64_t numBuckets, numRecords, nextFreePage, numBlocks, numOverflowBlocks, currentTotalSize;
+    int64_t valueHeapSize;
+    int64_t splitSourceBucket, splitChainPage;
+    int32_t splitPolicy, maxChainLength;
+    int32_t level;
+    int64_t splitPointer;
+    string bioDictionary;
+
+    void writeHeader(FileIO &indexFile)
+    {
+        memset(page, 0, sizeof(page));
+        pos = 0;
+
+        put(MAGIC);
+        put(VERSION);
+        put((uint32_t)Block::PAGE_SIZE);
+        put(keyWidth);
+        put((uint32_t)sizeof(int64_t)); // Width of page numbers and file offsets
+        put(level);
+        put(splitPointer);
+        put(numBuckets);
+        put(numRecords);
+        put(nextFreePage);
+        put(numBlocks);
+        put(numOverflowBlocks);
+        put(currentTotalSize);
+        put(flags);
+        put(valueHeapSize);
+        put(splitSourceBucket);
+        put(splitChainPage);
+        put(splitPolicy);
+        put(maxChainLength);
+        put((uint32_t)bioDictionary.length());
+        memcpy(page + pos, bioDictionary.data(), bioDictionary.length());
+
+        uint32_t checksum = Crc32c::compute(page, CHECKSUM_OFFSET);
+        memcpy(page + CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+        indexFile.write(0, page, sizeof(page));
+    }
+
+    // Read a header written by writeHeader, checking the file is an index in
+    // a format this build understands
+    void readHeader(FileIO &indexFile)
+    {
+        indexFile.read(0, page, sizeof(page));
+        pos = 0;
+
+        if (get<uint32_t>() != MAGIC)
+            throw runtime_error("Not an index file");
+        if (get<uint32_t>() != VERSION)
+            throw runtime_error("Unsupported index file version");
+
+        uint32_t checksum;
+        memcpy(&checksum, page + CHECKSUM_OFFSET, sizeof(checksum));
+        if (checksum != Crc32c::compute(page, CHECKSUM_OFFSET))
+            throw runtime_error("Index file header is corrupt");
+        if (get<uint32_t>() != (uint32_t)Block::PAGE_SIZE)
+            throw runtime_error("Index file has a different page size");
+        keyWidth = get<int32_t>();
+        if (get<uint32_t>() != sizeof(int64_t))
+            throw runtime_error("Index file has a different page number width");
+        level = get<int32_t>();
+        splitPointer = get<int64_t>();
+        numBuckets = get<int64_t>();
+        numRecords = get<int64_t>();
+        nextFreePage = get<int64_t>();
+        numBlocks = get<int64_t>();
+        numOverflowBlocks = get<int64_t>();
+        currentTotalSize = get<int64_t>();
+        flags = get<uint32_t>();
+        valueHeapSize = get<int64_t>();
+        splitSourceBucket = get<int64_t>();
+        splitChainPage = get<int64_t>();
+        splitPolicy = get<int32_t>();
+        maxChainLength = get<int32_t>();
+
+        uint32_t dictionaryLength = get<uint32_t>();
+        if (dictionaryLength > (uint32_t)(CHECKSUM_OFFSET - pos))
+            throw runtime_error("Index file header is corrupt");
+        bioDictionary.assign(page + pos, dictionaryLength);
+    }
+};
+
+class LinearHashIndex
+{
+
+private:
+    const int PAGE_SIZE = Block::PAGE_SIZE;
+
+    BucketDirectory pageDirectory;
+    int64_t numBlocks;
+
+    // Linear hashing state: numBuckets == 2^level + splitPointer. Buckets
+    // below splitPointer have been split this round and are addressed with
+    // level + 1 hash bits, the rest with level bits.
+    int64_t numBuckets;
+    int level;
+    int64_t splitPointer;
+    int64_t numRecords;   // Records in index
+    int64_t nextFreePage; // Next page to write to
+    string fName;         // Name of output index file
+    string heapFName;     // Name of the value heap file, when enabled
+    IndexOptions options;
+    int64_t valueHeapSize; // Bytes appended to the value heap
+    BioCodec bioCodec;     // Trained dictionary when bios are compressed
+
+    unique_ptr<FileIO> indexIO; // Open index file, kept for lookups
+    unique_ptr<FileIO> heapIO;  // Open value heap file, when enabled
+
+    BlockPool blockPool; // Reused page buffers for inserts and splits
+
+    FreeSpaceMap freeSpace;      // Free bytes and overflow pointer of every page
+    unique_ptr<FileIO> freeSpaceIO; // Sidecar file the free-space map is persisted to
+    string freeSpaceFName;
+
+    unique_ptr<FileIO> directoryIO; // Sidecar file the bucket directory is persisted to
+    string directoryFName;
+
+    shared_ptr<MappedFile> indexMap; // Mappings used for lookups when mapIndex is set
+    shared_ptr<MappedFile> heapMap;
+
+    // Lookups read the last published snapshot and never take a lock. Pages
+    // it can reach are not written again: an insert copies the tail page it
+    // adds to, and pages a change drops are only reused once every snapshot
+    // that could reach them has been released.
+    shared_ptr<const IndexSnapshot> published;
+    vector<bool> isPrivatePage; // Page allocated since the last publish
+    vector<int64_t> privatePages;
+    vector<int64_t> retiringPages; // Dropped since the last publish
+    struct RetiredPages
+    {
+        shared_ptr<const IndexSnapshot> snapshot; // Last snapshot that could reach them
+        vector<int64_t> pages;
+    };
+    deque<RetiredPages> retiredPages;
+    vector<int64_t> freePages;
+
+    PageBits checkedPages; // Pages that passed their checksum, with FIRST_READ
+
+    // The read pipeline shares one io_uring ring per file, so only one
+    // pipelined batch may submit to it at a time
+    mutex pipelineMutex;
+
+    int64_t numOverflowBlocks;
+
+    int64_t currentTotalSize;
+
+    // A split moves the old chain of its bucket a few pages per insert
+    // instead of all at once. Until it is done, records still on the old
+    // chain belong to either the source bucket or the new bucket (always the
+    // last one), so lookups on those two search the old chain as well.
+    static const int SPLIT_PAGES_PER_INSERT = 1;
+    int64_t splitSourceBucket; // -1 when no split is in progress
+    int64_t splitChainPage;    // Next old chain page still to be moved
+
+    Record getRecord(fstream &recordIn)
+    {
+        string line, word;
+        vector<std::string> fields;
+
+        if (!getline(recordIn, line, '\n'))
+        {
+            fields.push_back("-1");
+            fields.push_back("-1");
+            fields.push_back("-1");
+            fields.push_back("-1");
+            return Record(fields);
+        }
+        else
+        {
+            stringstream s(line);
+
+            getline(s, word, ',');
+            fields.push_back(word);
+            getline(s, word, ',');
+            fields.push_back(word);
+            getline(s, word, ',');
+            fields.push_back(word);
+            getline(s, word, ',');
+            fields.push_back(word);
+
+            return Record(fields);
+        }
+    }
+
+    static int64_t hash(int64_t id)
+    {
+        return (int64_t)((uint64_t)id % ((uint64_t)1 << 32));
+    }
+
+    void writeHeader(FileIO &indexFile)
+    {
+        IndexHeader header;
+        header.keyWidth = options.keyWidth;
+        header.level = level;
+        header.splitPointer = splitPointer;
+        header.numBuckets = numBuckets;
+        header.numRecords = numRecords;
+        header.nextFreePage = nextFreePage;
+        header.numBlocks = numBlocks;
+        header.numOverflowBlocks = numOverflowBlocks;
+        header.currentTotalSize = currentTotalSize;
+        header.flags = 0;
+        if (options.separateValueHeap)
+            header.flags |= IndexHeader::FLAG_VALUE_HEAP;
+        if (options.compressBio)
+        {
+            header.flags |= IndexHeader::FLAG_COMPRESSED_BIO;
+            header.bioDictionary = bioCodec.serialize();
+        }
+        header.valueHeapSize = valueHeapSize;
+        header.splitSourceBucket = splitSourceBucket;
+        header.splitChainPage = splitChainPage;
+        header.splitPolicy = (int32_t)options.splitPolicy;
+        header.maxChainLength = options.maxChainLength;
+        header.writeHeader(indexFile);
+    }
+
+    // Restore the counters and format options saved by writeHeader
+    void readHeader(FileIO &indexFile)
+    {
+        IndexHeader header;
+        header.readHeader(indexFile);
+        options.keyWidth = header.keyWidth;
+        level = header.level;
+        splitPointer = header.splitPointer;
+        numBuckets = header.numBuckets;
+        numRecords = header.numRecords;
+        nextFreePage = header.nextFreePage;
+        numBlocks = header.numBlocks;
+        numOverflowBlocks = header.numOverflowBlocks;
+        currentTotalSize = header.currentTotalSize;
+        options.separateValueHeap = (header.flags & IndexHeader::FLAG_VALUE_HEAP) != 0;
+        options.compressBio = (header.flags & IndexHeader::FLAG_COMPRESSED_BIO) != 0;
+        if (options.compressBio)
+            bioCodec.deserialize(header.bioDictionary.data());
+        valueHeapSize = header.valueHeapSize;
+        splitSourceBucket = header.splitSourceBucket;
+        splitChainPage = header.splitChainPage;
+        options.splitPolicy = (SplitPolicy)header.splitPolicy;
+        options.maxChainLength = header.maxChainLength;
+    }
+
+    // Open one of the index's files, in memory when the index is kept there.
+    // Without truncate an in-memory file starts out with the saved contents.
+    unique_ptr<FileIO> openIndexFile(const string &path, bool truncate, bool useIoUring)
+    {
+        if (!options.inMemory)
+            return openFileIO(path, truncate, useIoUring, options.readOnly);
+
+        unique_ptr<MemoryFileIO> file(new MemoryFileIO());
+        if (!truncate)
+            file->loadFrom(path);
+        return unique_ptr<FileIO>(move(file));
+    }
+
+    // Write the sidecar files and header after a change
+    void flushMetadata()
+    {
+        writeHeader(*indexIO);
+        freeSpace.persist(*freeSpaceIO);
+        pageDirectory.persist(*directoryIO);
+    }
+
+    // A page of '*' written over pages that have been freed
+    static const string &freedPageMarker()
+    {
+        static const string marker(Block::PAGE_SIZE, '*');
+        return marker;
+    }
+
+    // A page to write a new block to: a freed one if there is one, else the
+    // next one at the end of the file
+    int64_t allocatePage()
+    {
+        int64_t pgIdx;
+        if (!freePages.empty())
+        {
+            pgIdx = freePages.back();
+            freePages.pop_back();
+        }
+        else
+        {
+            pgIdx = nextFreePage++;
+        }
+
+        if (pgIdx >= (int64_t)isPrivatePage.size())
+            isPrivatePage.resize(pgIdx + 1, false);
+        isPrivatePage[pgIdx] = true;
+        privatePages.push_back(pgIdx);
+        return pgIdx;
+    }
+
+    bool isPrivate(int64_t pgIdx)
+    {
+        return pgIdx < (int64_t)isPrivatePage.size() && isPrivatePage[pgIdx];
+    }
+
+    // Mark a page emptied and make it available to allocatePage. Whatever is
+    // written there next has to pass its own checksum.
+    void freePage(int64_t pgIdx, FileIO &indexFile)
+    {
+        indexFile.write(pgIdx * PAGE_SIZE, freedPageMarker().data(), PAGE_SIZE);
+        checkedPages.reset(pgIdx);
+        freeSpace.setFree(pgIdx, 0);
+        freeSpace.setNext(pgIdx, -1);
+        freeSpace.clearKeys(pgIdx);
+        freePages.push_back(pgIdx);
+    }
+
+    // Drop a page from the index. One no snapshot has seen is freed at once,
+    // others once the snapshots that can reach them are released.
+    void releasePage(int64_t pgIdx, FileIO &indexFile)
+    {
+        if (isPrivate(pgIdx))
+        {
+            isPrivatePage[pgIdx] = false;
+            freePage(pgIdx, indexFile);
+        }
+        else
+        {
+            retiringPages.push_back(pgIdx);
+        }
+    }
+
+    // Forget all snapshots and page bookkeeping, before the index is rebuilt
+    // or reloaded
+    void resetSnapshots()
+    {
+        atomic_store(&published, shared_ptr<const IndexSnapshot>());
+        isPrivatePage.clear();
+        privatePages.clear();
+        retiringPages.clear();
+        retiredPages.clear();
+        freePages.clear();
+        checkedPages.clear();
+        indexMap.reset();
+        heapMap.reset();
+    }
+
+    // Make the index as it is now visible to lookups, then free the pages of
+    // snapshots no lookup holds any more
+    void publishSnapshot()
+    {
+        if (options.mapIndex && !options.inMemory)
+        {
+            // Remap only once the files have grown past the mappings, which
+            // are made twice the size needed so growth remaps only now and
+            // then; older snapshots keep the mappings they were published with
+            if (!indexMap || (int64_t)indexMap->size() < nextFreePage * PAGE_SIZE)
+                indexMap = MappedFile::map(fName, 2 * nextFreePage * PAGE_SIZE);
+            if (options.separateValueHeap && (!heapMap || (int64_t)heapMap->size() < valueHeapSize))
+                heapMap = MappedFile::map(heapFName, 2 * valueHeapSize);
+        }
+
+        shared_ptr<IndexSnapshot> snapshot = make_shared<IndexSnapshot>();
+        snapshot->level = level;
+        snapshot->splitPointer = splitPointer;
+        snapshot->numBuckets = numBuckets;
+        snapshot->splitSourceBucket = splitSourceBucket;
+        snapshot->splitChainPage = splitChainPage;
+        snapshot->buckets = pageDirectory.bucketEntries();
+        snapshot->pages = freeSpace.pageLinks();
+        snapshot->indexMap = indexMap;
+        snapshot->heapMap = heapMap;
+
+        shared_ptr<const IndexSnapshot> previous = atomic_load(&published);
+        atomic_store(&published, shared_ptr<const IndexSnapshot>(snapshot));
+
+        if (previous)
+        {
+            // Kept even without pages, so an older snapshot still in use holds
+            // back the pages retired after it
+            RetiredPages retired;
+            retired.snapshot = previous;
+            retired.pages.swap(retiringPages);
+            retiredPages.push_back(move(retired));
+        }
+        else
+        {
+            for (int64_t pgIdx : retiringPages)
+                freePage(pgIdx, *indexIO);
+            retiringPages.clear();
+        }
+
+        for (int64_t pgIdx : privatePages)
+            isPrivatePage[pgIdx] = false;
+        privatePages.clear();
+
+        while (!retiredPages.empty() && retiredPages.front().snapshot.use_count() == 1)
+        {
+            atomic_thread_fence(memory_order_acquire);
+            for (int64_t pgIdx : retiredPages.front().pages)
+                freePage(pgIdx, *indexIO);
+            retiredPages.pop_front();
+        }
+    }
+
+    void writeEmptyBlock(int64_t pgIdx, FileIO &indexFile)
+    {
+        BlockPool::Handle emptyBlock = blockPool.acquire(pgIdx, options);
+        emptyBlock->initEmpty();
+        emptyBlock->writeBlock(indexFile);
+
+        freeSpace.setFree(pgIdx, PAGE_SIZE - Block::HEADER_SIZE);
+        freeSpace.setNext(pgIdx, -1);
+        freeSpace.clearKeys(pgIdx);
+    }
+
+    int64_t initBucket(FileIO &indexFile)
+    {
+
+        int64_t pgIdx = allocatePage();
+        writeEmptyBlock(pgIdx, indexFile);
+
+        int64_t bucketIdx = pageDirectory.addBucket(pgIdx);
+        numBlocks++;
+        numBuckets++;
+
+        // Update current total size
+        currentTotalSize += Block::HEADER_SIZE;
+
+        return bucketIdx;
+    }
+
+    int64_t initOverflowBlock(int64_t parentBlockIdx, FileIO &indexFile)
+    {
+
+        // Get index of current overflow block
+        int64_t currIdx = allocatePage();
+
+        writeEmptyBlock(currIdx, indexFile);
+
+        // Overflow pointer is the first field of the parent's page header
+        indexFile.write(parentBlockIdx * PAGE_SIZE, reinterpret_cast<const char *>(&currIdx), sizeof(currIdx));
+        freeSpace.setNext(parentBlockIdx, currIdx);
+
+        currentTotalSize += Block::HEADER_SIZE;
+
+        // Update number of overflow blocks and blocks
+        numBlocks++;
+        numOverflowBlocks++;
+
+        return currIdx;
+    }
+
+    int64_t initEmptyBlock(FileIO &indexFile)
+    {
+
+        // Get index for current block
+        int64_t currIdx = allocatePage();
+
+        writeEmptyBlock(currIdx, indexFile);
+
+        // Update current total size
+        currentTotalSize += Block::HEADER_SIZE;
+
+        numBlocks++;
+
+        return currIdx;
+    }
+
+    // Whether a page just read or attached matches its checksum. With
+    // FIRST_READ a page that has passed once is not checked again.
+    bool pageIntact(const Block &block)
+    {
+        if (options.checksumCheck == ChecksumCheck::FIRST_READ)
+        {
+            if (checkedPages.test(block.blockIdx))
+                return true;
+            if (!block.checksumMatches())
+                return false;
+            checkedPages.set(block.blockIdx);
+            return true;
+        }
+        return block.checksumMatches();
+    }
+
+    void checkPage(const Block &block)
+    {
+        if (!pageIntact(block))
+        {
+            throw runtime_error("Page " + to_string(block.blockIdx) + " of " + fName + " failed its checksum");
+        }
+    }
+
+    // Read a page for the writer, refusing to build on a corrupt one
+    void readPage(Block &block, FileIO &indexFile)
+    {
+        block.readBlock(indexFile);
+        checkPage(block);
+    }
+
+    // Add a record to an already loaded block and write the page back
+    void writeRecordToBlock(Record &record, Block &block, FileIO &indexFile)
+    {
+        block.addRecord(record);
+        block.writeBlock(indexFile);
+        freeSpace.setFree(block.blockIdx, PAGE_SIZE - block.blockSize);
+        freeSpace.addKey(block.blockIdx, record.id);
+
+        // Update current total size
+        currentTotalSize += record.getSize(options);
+    }
+
+    // Get overflow index and write record to overflow block
+    int64_t writeRecordToOverflowBlock(Record &record, int64_t baseBlockPgIdx, FileIO &indexFile)
+    {
+        int64_t overflowIdx = initOverflowBlock(baseBlockPgIdx, indexFile);
+        BlockPool::Handle overflowBlock = blockPool.acquire(overflowIdx, options);
+        overflowBlock->initEmpty();
+        writeRecordToBlock(record, *overflowBlock, indexFile);
+        return overflowIdx;
+    }
+
+    // Append a record to the tail page of a bucket's chain, starting a new
+    // overflow page when the tail is full
+    void writeRecordToIndexFile(Record &record, int64_t bucketIdx, FileIO &indexFile)
+    {
+        if (Block::HEADER_SIZE + record.getSize(options) > PAGE_SIZE)
+        {
+            throw length_error("Record " + to_string(record.id) + " does not fit in a page");
+        }
+
+        int64_t tailPgIdx = pageDirectory.tailPage(bucketIdx);
+        if (freeSpace.getFree(tailPgIdx) < record.getSize(options))
+        {
+            int64_t overflowIdx = writeRecordToOverflowBlock(record, tailPgIdx, indexFile);
+            pageDirectory.appendPage(bucketIdx, overflowIdx);
+        }
+        else if (isPrivate(tailPgIdx))
+        {
+            BlockPool::Handle block = blockPool.acquire(tailPgIdx, options);
+            readPage(*block, indexFile);
+            writeRecordToBlock(record, *block, indexFile);
+        }
+        else
+        {
+            copyTailPage(record, bucketIdx, indexFile);
+        }
+        pageDirectory.addKey(bucketIdx, record.id);
+    }
+
+    // Add a record to a copy of a bucket's tail page, leaving the page a
+    // published snapshot can see as it is
+    void copyTailPage(Record &record, int64_t bucketIdx, FileIO &indexFile)
+    {
+        int64_t tailPgIdx = pageDirectory.tailPage(bucketIdx);
+        int64_t copyPgIdx = allocatePage();
+
+        BlockPool::Handle block = blockPool.acquire(tailPgIdx, options);
+        readPage(*block, indexFile);
+        block->blockIdx = copyPgIdx;
+        freeSpace.copyPage(tailPgIdx, copyPgIdx);
+        writeRecordToBlock(record, *block, indexFile);
+
+        // Relink the page before the tail. Its overflow pointer is written in
+        // place: lookups follow the links of their snapshot, not the page's.
+        int64_t headPgIdx = pageDirectory.headPage(bucketIdx);
+        if (headPgIdx != tailPgIdx)
+        {
+            int64_t prevPgIdx = headPgIdx;
+            while (freeSpace.getNext(prevPgIdx) != tailPgIdx)
+                prevPgIdx = freeSpace.getNext(prevPgIdx);
+            indexFile.write(prevPgIdx * PAGE_SIZE, reinterpret_cast<const char *>(&copyPgIdx), sizeof(copyPgIdx));
+            freeSpace.setNext(prevPgIdx, copyPgIdx);
+        }
+
+        pageDirectory.replaceTailPage(bucketIdx, copyPgIdx);
+        releasePage(tailPgIdx, indexFile);
+    }
+
+    // Initialize buckets if no records are present
+    void initBucketsIfNecessary(FileIO &indexFile)
+    {
+        if (numRecords == 0)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                initBucket(indexFile);
+            }
+            level = 1;
+            splitPointer = 0;
+        }
+    }
+
+    // Write a record to the index file and update record count
+    void writeRecordAndUpdateCount(Record &record, int64_t bucketIdx, FileIO &indexFile)
+    {
+        writeRecordToIndexFile(record, bucketIdx, indexFile);
+        numRecords++;
+    }
+
+    // Whether the split policy calls for a split after an insert into bucketIdx
+    bool needsSplit(int64_t bucketIdx)
+    {
+        double avgCapacityPerBucket = (double)currentTotalSize / numBuckets;
+        double pageSizeMul = 0.7 * PAGE_SIZE;
+        bool loadTooHigh = avgCapacityPerBucket > pageSizeMul;
+
+        // A long chain only counts once buckets are reasonably full, so keys
+        // that all hash alike cannot keep adding near-empty buckets
+        bool chainTooLong = pageDirectory.chainLength(bucketIdx) > options.maxChainLength &&
+                            avgCapacityPerBucket > pageSizeMul / 2;
+
+        switch (options.splitPolicy)
+        {
+        case SplitPolicy::CHAIN_LENGTH:
+            return chainTooLong;
+        case SplitPolicy::HYBRID:
+            return loadTooHigh || chainTooLong;
+        default:
+            return loadTooHigh;
+        }
+    }
+
+    // Start splitting the next bucket in sequence when the split policy says
+    // so after an insert into bucketIdx, and move part of any split in progress
+    void handleBucketOverflow(int64_t bucketIdx, FileIO &indexFile)
+    {
+        if (splitSourceBucket == -1 && needsSplit(bucketIdx))
+        {
+            startSplit(indexFile);
+        }
+        advanceSplit(SPLIT_PAGES_PER_INSERT, indexFile);
+    }
+
+    // Split the bucket at the split pointer into itself and a new bucket
+    // 2^level above it: add the new bucket, point the old one at a fresh page
+    // and leave the old chain in place for advanceSplit to drain.
+    void startSplit(FileIO &indexFile)
+    {
+        int64_t bucketToTransferFromIdx = splitPointer;
+        initBucket(indexFile);
+
+        splitPointer++;
+        if (splitPointer == ((int64_t)1 << level))
+        {
+            level++;
+            splitPointer = 0;
+        }
+
+        splitSourceBucket = bucketToTransferFromIdx;
+        splitChainPage = pageDirectory.headPage(bucketToTransferFromIdx);
+
+        int64_t newOldBucketPageIdx = initEmptyBlock(indexFile);
+        pageDirectory.resetBucket(bucketToTransferFromIdx, newOldBucketPageIdx);
+
+        numOverflowBlocks++;
+    }
+
+    // Move up to maxPages pages of the old chain of the split in progress
+    // into the source and new buckets
+    void advanceSplit(int maxPages, FileIO &indexFile)
+    {
+        if (splitSourceBucket == -1)
+            return;
+
+        // Pages are borrowed from the pool and records decoded into one
+        // reused Record while the old chain is redistributed
+        BlockPool::Handle block = blockPool.acquire(splitChainPage, options);
+        Block &oldBlock = *block;
+        Record movedRecord;
+
+        for (int moved = 0; moved < maxPages && splitChainPage != -1; moved++)
+        {
+            oldBlock.blockIdx = splitChainPage;
+            readPage(oldBlock, indexFile);
+
+            numBlocks--;
+            numOverflowBlocks--;
+
+            currentTotalSize -= oldBlock.blockSize;
+            numRecords -= oldBlock.numRecords;
+
+            for (int i = 0; i < oldBlock.numRecords; i++)
+            {
+                oldBlock.getRecord(i, movedRecord);
+                writeRecordToIndexFile(movedRecord, getBucketIdx(movedRecord.id), indexFile);
+                numRecords++;
+            }
+
+            // Only release the page once its records are reachable from their
+            // new buckets
+            splitChainPage = oldBlock.overflowPtrIdx;
+            releasePage(oldBlock.blockIdx, indexFile);
+        }
+
+        if (splitChainPage == -1)
+            splitSourceBucket = -1;
+    }
+
+    // Move whatever is left of the split in progress
+    void finishSplit(FileIO &indexFile)
+    {
+        while (splitSourceBucket != -1)
+            advanceSplit(SPLIT_PAGES_PER_INSERT, indexFile);
+    }
+
+    // Old chain a lookup in bucketIdx must also search, or -1
+    static int64_t getSplitChainPage(const IndexSnapshot &snapshot, int64_t bucketIdx)
+    {
+        if (snapshot.splitSourceBucket != -1 &&
+            (bucketIdx == snapshot.splitSourceBucket || bucketIdx == snapshot.numBuckets - 1))
+            return snapshot.splitChainPage;
+        return -1;
+    }
+
+    // First page from pgIdx on whose key filter does not rule id out,
+    // following the chain through the snapshot's page links without reading
+    // pages. At the end of the chain the walk continues once with splitPgIdx,
+    // the old chain of a split in progress. Returns -1 when no page is left.
+    static int64_t nextLookupPage(const IndexSnapshot &snapshot, int64_t pgIdx, int64_t id, int64_t &splitPgIdx)
+    {
+        while (true)
+        {
+            if (pgIdx == -1)
+            {
+                if (splitPgIdx == -1)
+                    return -1;
+                pgIdx = splitPgIdx;
+                splitPgIdx = -1;
+            }
+            const PageLinks &links = snapshot.pages[pgIdx];
+            if (links.mayContain(id))
+                return pgIdx;
+            pgIdx = links.nextPage;
+        }
+    }
+
+    // Pages a lookup for id starts from: the first page of the bucket's chain
+    // that may hold id, unless the bucket's own filter rules id out, and the
+    // old chain of a split in progress to continue with. pgIdx is -1 when
+    // there is nothing to read.
+    static void getLookupChains(const IndexSnapshot &snapshot, int64_t id, int64_t &pgIdx, int64_t &splitPgIdx)
+    {
+        int64_t bucketIdx = bucketFor(id, snapshot.level, snapshot.splitPointer);
+        const BucketEntry &bucket = snapshot.buckets[bucketIdx];
+        pgIdx = bucket.mayContain(id) ? bucket.headPage : -1;
+        splitPgIdx = getSplitChainPage(snapshot, bucketIdx);
+        pgIdx = nextLookupPage(snapshot, pgIdx, id, splitPgIdx);
+    }
+
+    // Append the record's name and bio to the value heap and point the record at them
+    void appendToValueHeap(Record &record, FileIO &heapFile)
+    {
+        // Their lengths are stored as 16 bits
+        if (record.name.length() > UINT16_MAX || record.bio.length() > UINT16_MAX)
+        {
+            throw length_error("Name or bio of record " + to_string(record.id) + " is too long");
+        }
+
+        vector<char> value(record.getValueSize());
+        record.writeValue(value.data());
+
+        heapFile.write(valueHeapSize, value.data(), value.size());
+
+        record.valueOffset = valueHeapSize;
+        record.valueLength = value.size();
+        valueHeapSize += value.size();
+    }
+
+    // Fill in name and bio, as far as the mask asks for them, of a record
+    // whose value lives in the value heap
+    void readFromValueHeap(const IndexSnapshot &snapshot, Record &record, FileIO &heapFile,
+                           uint32_t fields = Record::ALL_FIELDS)
+    {
+        if (snapshot.heapMap)
+        {
+            record.readValue(snapshot.heapMap->at(record.valueOffset), fields);
+            return;
+        }
+        if (const char *value = heapFile.memoryAt(record.valueOffset, record.valueLength))
+        {
+            record.readValue(value, fields);
+            return;
+        }
+
+        vector<char> value(record.valueLength);
+        heapFile.read(record.valueOffset, value.data(), value.size());
+        record.readValue(value.data(), fields);
+    }
+
+    int64_t getBucketIdx(int64_t id)
+    {
+        return bucketFor(id, level, splitPointer);
+    }
+
+    // A page that can be used in place, from the snapshot's mapping or an
+    // in-memory index; nullptr when it has to be read
+    const char *residentPage(const IndexSnapshot &snapshot, int64_t pgIdx)
+    {
+        if (snapshot.indexMap)
+            return snapshot.indexMap->at(pgIdx * PAGE_SIZE);
+        return indexIO->memoryAt(pgIdx * PAGE_SIZE, PAGE_SIZE);
+    }
+
+    // Load a page for a lookup, in place when it is resident
+    void fetchBlock(const IndexSnapshot &snapshot, Block &block)
+    {
+        if (const char *page = residentPage(snapshot, block.blockIdx))
+            block.attach(page);
+        else
+            block.readBlock(*indexIO);
+        checkPage(block);
+    }
+
+    // Hint that a lookup is about to read a page's header and key array
+    void prefetchPage(const IndexSnapshot &snapshot, int64_t pgIdx)
+    {
+        if (pgIdx == -1)
+            return;
+        if (const char *page = residentPage(snapshot, pgIdx))
+            prefetchBytes(page, 256);
+    }
+
+    // Walk the pages getLookupChains picked for one id, prefetching each next
+    // page that may hold it while the current one is searched. Returns id -1
+    // when not found, else the record with the fields in the mask.
+    Record walkChain(const IndexSnapshot &snapshot, int64_t id, int64_t pgIdx, int64_t splitPgIdx, uint32_t fields)
+    {
+        Block currBlock(pgIdx, options, Block::UNREAD);
+        while (pgIdx != -1)
+        {
+            currBlock.blockIdx = pgIdx;
+            fetchBlock(snapshot, currBlock);
+            int64_t nextPgIdx = nextLookupPage(snapshot, snapshot.pages[pgIdx].nextPage, id, splitPgIdx);
+            prefetchPage(snapshot, nextPgIdx);
+
+            // Compare against the page's key array and only decode the match
+            int slot = currBlock.findSlot(id);
+            if (slot != -1)
+            {
+                Record found;
+                currBlock.getRecord(slot, found, fields);
+                if (options.separateValueHeap && (fields & Record::VALUE_FIELDS))
+                {
+                    readFromValueHeap(snapshot, found, *heapIO, fields);
+                }
+                finishFoundRecord(found, fields);
+                return found;
+            }
+
+            pgIdx = nextPgIdx;
+        }
+
+        // Not found
+        return Record();
+    }
+
+    // One lookup in the pipeline. The probe is always either finished or
+    // waiting on exactly one read into its own buffers.
+    struct LookupProbe
+    {
+        enum State
+        {
+            WAIT_PAGE,
+            WAIT_VALUE,
+            DONE
+        };
+
+        State state;
+        uint32_t fields; // Fields the lookup asked for
+        size_t idIdx;
+        int64_t id;
+        int64_t splitPage;   // Old chain to search after the bucket's own, or -1
+        int64_t corruptPage; // Page that failed its checksum, or -1
+        Block block;
+        vector<char> value;
+        Record found;
+
+        LookupProbe(const IndexOptions &format, uint32_t wantedFields) : block(-1, format, Block::UNREAD)
+        {
+            state = DONE;
+            fields = wantedFields;
+            idIdx = 0;
+            id = -1;
+            splitPage = -1;
+            corruptPage = -1;
+        }
+    };
+
+    vector<LookupProbe> probePool; // Kept between batches, under pipelineMutex
+
+    // Queue the read the probe is waiting on, tagged with its slot
+    void issueProbeRead(LookupProbe &probe, uint64_t slot)
+    {
+        if (probe.state == LookupProbe::WAIT_PAGE)
+        {
+            indexIO->submitRead(probe.block.blockIdx * PAGE_SIZE, probe.block.data(), PAGE_SIZE, slot);
+        }
+        else
+        {
+            probe.value.resize(probe.found.valueLength);
+            heapIO->submitRead(probe.found.valueOffset, probe.value.data(), probe.found.valueLength, slot);
+        }
+    }
+
+    // Advance a probe whose read has completed to its next state
+    void resumeProbe(const IndexSnapshot &snapshot, LookupProbe &probe)
+    {
+        if (probe.state == LookupProbe::WAIT_VALUE)
+        {
+            probe.found.readValue(probe.value.data(), probe.fields);
+            finishFoundRecord(probe.found, probe.fields);
+            probe.state = LookupProbe::DONE;
+            return;
+        }
+
+        Block &currBlock = probe.block;
+        currBlock.loadHeader();
+        if (!pageIntact(currBlock))
+        {
+            probe.corruptPage = currBlock.blockIdx;
+            probe.state = LookupProbe::DONE;
+            return;
+        }
+
+        int slot = currBlock.findSlot(probe.id);
+        if (slot != -1)
+        {
+            currBlock.getRecord(slot, probe.found, probe.fields);
+            if (options.separateValueHeap && (probe.fields & Record::VALUE_FIELDS))
+            {
+                probe.state = LookupProbe::WAIT_VALUE;
+                return;
+            }
+            finishFoundRecord(probe.found, probe.fields);
+            probe.state = LookupProbe::DONE;
+        }
+        else
+        {
+            currBlock.blockIdx = nextLookupPage(snapshot, snapshot.pages[currBlock.blockIdx].nextPage, probe.id,
+                                                probe.splitPage);
+            if (currBlock.blockIdx == -1)
+                probe.state = LookupProbe::DONE;
+        }
+    }
+
+    // Undo the encodings applied on insert once a record has been found
+    void finishFoundRecord(Record &found, uint32_t fields = Record::ALL_FIELDS)
+    {
+        if (options.compressBio && (fields & Record::FIELD_BIO))
+        {
+            found.bio = bioCodec.decode(found.bio);
+        }
+    }
+
+    void insertRecord(Record &record, FileIO &indexFile)
+    {
+        if (options.keyWidth == sizeof(int32_t) && record.id != (int32_t)record.id)
+        {
+            throw out_of_range("ID " + to_string(record.id) + " does not fit in a 32-bit key");
+        }
+
+        initBucketsIfNecessary(indexFile);
+        if (options.compressBio)
+        {
+            record.bio = bioCodec.encode(record.bio);
+        }
+
+        if (options.separateValueHeap)
+        {
+            appendToValueHeap(record, *heapIO);
+        }
+
+        int64_t bucketIdx = getBucketIdx(record.id);
+        writeRecordAndUpdateCount(record, bucketIdx, indexFile);
+        handleBucketOverflow(bucketIdx, indexFile);
     }
 
 public:
-    LinearHashIndex(string indexFileName)
+    LinearHashIndex(string indexFileName, IndexOptions indexOptions = IndexOptions())
     {
+        if (indexOptions.keyWidth != sizeof(int32_t) && indexOptions.keyWidth != sizeof(int64_t))
+        {
+            throw invalid_argument("Key width must be 4 or 8 bytes");
+        }
+        if (indexOptions.maxChainLength < 1)
+        {
+            throw invalid_argument("Maximum chain length must be at least 1 page");
+        }
+        options = indexOptions;
         numBlocks = 0;
-        i = 0;
+        level = 0;
+        splitPointer = 0;
         numRecords = 0;
         numBuckets = 0;
         fName = indexFileName;
+        heapFName = indexFileName + ".heap";
+        freeSpaceFName = indexFileName + ".fsm";
+        directoryFName = indexFileName + ".dir";
+        valueHeapSize = 0;
+        splitSourceBucket = -1;
+        splitChainPage = -1;
         numOverflowBlocks = 0;
         currentTotalSize = 0;
-        nextFreePage = 0;
+        nextFreePage = 1; // Page 0 holds the file header
+    }
+
+    // Bucket an id hashes to under the given linear hashing state: the low
+    // level bits of its hash, or level + 1 bits if that bucket has already
+    // been split this round
+    static int64_t bucketFor(int64_t id, int level, int64_t splitPointer)
+    {
+        int64_t hashVal = hash(id);
+        int64_t unsplitIdx = hashVal & (((int64_t)1 << level) - 1);
+        int64_t splitIdx = hashVal & (((int64_t)2 << level) - 1);
+        return unsplitIdx < splitPointer ? splitIdx : unsplitIdx;
+    }
+
+    // Train the bio dictionary on the first records of the input file
+    void trainBioCodec(string csvFName)
+    {
+        const int SAMPLE_RECORDS = 1000;
+
+        fstream inputFile(csvFName, ios::in);
+        vector<string> samples;
+        while ((int)samples.size() < SAMPLE_RECORDS)
+        {
+            Record sample = getRecord(inputFile);
+            if (sample.id == -1)
+                break;
+            samples.push_back(sample.bio);
+        }
+        bioCodec.train(samples, IndexHeader::MAX_DICTIONARY_SIZE);
     }
 
     void createFromFile(string csvFName)
     {
-        fstream indexFile(fName, ios::in | ios::out | ios::trunc | ios::binary);
+        if (options.readOnly)
+        {
+            throw logic_error("Index was opened read-only");
+        }
+
+        resetSnapshots();
+        freeSpace.clear();
+        pageDirectory.clear();
+
+        if (options.compressBio)
+            trainBioCodec(csvFName);
+
+        indexIO = openIndexFile(fName, true, options.useIoUring);
+        freeSpaceIO = openIndexFile(freeSpaceFName, true, false);
+        directoryIO = openIndexFile(directoryFName, true, false);
         fstream inputFile(csvFName, ios::in);
+        if (options.separateValueHeap)
+            heapIO = openIndexFile(heapFName, true, options.useIoUring);
 
         if (inputFile.is_open())
-            cout << "Employee.csv opened" << endl;
+            clog << "Employee.csv opened" << endl;
+
+        writeHeader(*indexIO);
 
         bool recordsRemaining = true;
 
@@ -403,40 +2406,357 @@ public:
             }
             else
             {
-                insertRecord(singleRec, indexFile);
+                insertRecord(singleRec, *indexIO);
             }
         }
-        indexFile.close();
+        finishSplit(*indexIO);
+        flushMetadata();
         inputFile.close();
+
+        publishSnapshot();
+    }
+
+    // Open the index last written to the index file and its sidecar files by
+    // createFromFile, insert or snapshot. Format options come from the file;
+    // with inMemory set the files are read into memory.
+    void load()
+    {
+        resetSnapshots();
+
+        indexIO = openIndexFile(fName, false, options.useIoUring);
+        readHeader(*indexIO);
+        freeSpaceIO = openIndexFile(freeSpaceFName, false, false);
+        directoryIO = openIndexFile(directoryFName, false, false);
+        heapIO.reset();
+        if (options.separateValueHeap)
+            heapIO = openIndexFile(heapFName, false, options.useIoUring);
+
+        if (!freeSpace.load(*freeSpaceIO))
+            throw runtime_error("Cannot read free-space map " + freeSpaceFName);
+        if (!pageDirectory.load(*directoryIO) || pageDirectory.size() != numBuckets)
+            throw runtime_error("Cannot read bucket directory " + directoryFName);
+
+        publishSnapshot();
     }
 
-    Record findRecordById(int id)
+    // Make the index durable. An in-memory index is written to the index file
+    // and its sidecar files, in the same format createFromFile writes, each
+    // replaced whole; an index on disk has its files flushed. Either way the
+    // index file, whose header the sidecars must match, goes last.
+    void snapshot()
     {
-        fstream indexFile(fName, ios::in);
+        if (!indexIO)
+        {
+            throw logic_error("Index has not been created");
+        }
+        if (options.readOnly)
+        {
+            throw logic_error("Index was opened read-only");
+        }
+
+        flushMetadata();
 
-        int bucketIdx = getLastIthBits(hash(id), i);
+        vector<pair<FileIO *, string>> files;
+        if (heapIO)
+            files.push_back(make_pair(heapIO.get(), heapFName));
+        files.push_back(make_pair(freeSpaceIO.get(), freeSpaceFName));
+        files.push_back(make_pair(directoryIO.get(), directoryFName));
+        files.push_back(make_pair(indexIO.get(), fName));
 
-        if (bucketIdx >= numBuckets)
+        if (!options.inMemory)
         {
-            bucketIdx &= ~(1 << (i - 1));
+            for (auto &file : files)
+                file.first->sync();
+            return;
         }
 
-        int pgIdx = pageDirectory[bucketIdx];
+        // Flush every temporary file before any replaces the file it stands
+        // for, so a crash leaves at most the renames partly done
+        for (auto &file : files)
+            static_cast<MemoryFileIO &>(*file.first).saveTo(file.second + ".tmp");
+        for (auto &file : files)
+        {
+            string tmpPath = file.second + ".tmp";
+            if (rename(tmpPath.c_str(), file.second.c_str()) != 0)
+                throw runtime_error("Cannot replace " + file.second + ": " + strerror(errno));
+        }
+        syncDirectoryOf(fName);
+    }
 
-        while (pgIdx != -1)
+    // Add one record to an index built by createFromFile. Lookups may run
+    // concurrently with an insert and see the index as it was before or after
+    // it; only one insert may run at a time.
+    void insert(Record record)
+    {
+        if (!indexIO)
+        {
+            throw logic_error("Index has not been created");
+        }
+        if (options.readOnly)
+        {
+            throw logic_error("Index was opened read-only");
+        }
+
+        insertRecord(record, *indexIO);
+        flushMetadata();
+        publishSnapshot();
+    }
+
+    IndexStats getStats()
+    {
+        IndexStats stats;
+        stats.numRecords = numRecords;
+        stats.numBuckets = numBuckets;
+        stats.numBlocks = numBlocks;
+        stats.numOverflowBlocks = numOverflowBlocks;
+        stats.longestChain = 0;
+        for (int64_t b = 0; b < pageDirectory.size(); b++)
+            stats.longestChain = max(stats.longestChain, pageDirectory.chainLength(b));
+        return stats;
+    }
+
+    // fields is a mask of Record::FIELD_*; only those fields are copied out of
+    // the page or value heap, so a walk up the manager chain can pass
+    // FIELD_MANAGER_ID and never touch a name or bio
+    Record findRecordById(int64_t id, uint32_t fields = Record::ALL_FIELDS)
+    {
+        shared_ptr<const IndexSnapshot> snapshot = atomic_load(&published);
+        if (!snapshot || snapshot->numBuckets == 0)
+            return Record();
+
+        int64_t pgIdx, splitPgIdx;
+        getLookupChains(*snapshot, id, pgIdx, splitPgIdx);
+        return walkChain(*snapshot, id, pgIdx, splitPgIdx, fields);
+    }
+
+    // Look up many ids with up to maxInFlight probes interleaved. Each probe
+    // is a small state machine that waits on one read at a time (a chain page
+    // or its value in the heap); whenever a read completes the scheduler
+    // resumes that probe, and a finished probe's slot is refilled with the next
+    // id straight away. onResult receives each id's position in ids and its
+    // record (id -1 when not found), in completion order. Throws if a page
+    // fails its checksum, after which the remaining ids get no result. Only
+    // the fields in the mask are filled in, and no value heap reads are made
+    // when it leaves out name and bio.
+    void lookupPipelined(const vector<int64_t> &ids, const function<void(size_t, Record &)> &onResult,
+                         size_t maxInFlight = 256, uint32_t fields = Record::ALL_FIELDS)
+    {
+        shared_ptr<const IndexSnapshot> snapshot = atomic_load(&published);
+        if (!snapshot || snapshot->numBuckets == 0)
+        {
+            Record notFound;
+            for (size_t k = 0; k < ids.size(); k++)
+                onResult(k, notFound);
+            return;
+        }
+
+        if (snapshot->indexMap || options.inMemory)
+        {
+            // Pages are used in place, so there is nothing to wait on. Group
+            // prefetching: pull in the bucket page of the id a few positions
+            // ahead while the current one is looked up
+            const size_t PREFETCH_DISTANCE = 8;
+            vector<int64_t> chainPages(ids.size()), splitPages(ids.size());
+            for (size_t k = 0; k < ids.size(); k++)
+            {
+                getLookupChains(*snapshot, ids[k], chainPages[k], splitPages[k]);
+                if (k < PREFETCH_DISTANCE)
+                    prefetchPage(*snapshot, chainPages[k]);
+            }
+            for (size_t k = 0; k < ids.size(); k++)
+            {
+                if (k + PREFETCH_DISTANCE < ids.size())
+                    prefetchPage(*snapshot, chainPages[k + PREFETCH_DISTANCE]);
+                Record found = walkChain(*snapshot, ids[k], chainPages[k], splitPages[k], fields);
+                onResult(k, found);
+            }
+            return;
+        }
+
+        lock_guard<mutex> pipelineLock(pipelineMutex);
+
+        // Probes and their page buffers are reused from earlier batches
+        size_t numProbes = min(maxInFlight, ids.size());
+        if (probePool.size() < numProbes)
+            probePool.resize(numProbes, LookupProbe(options, fields));
+        for (size_t slot = 0; slot < numProbes; slot++)
+        {
+            probePool[slot].block.format = options;
+            probePool[slot].fields = fields;
+            probePool[slot].state = LookupProbe::DONE;
+        }
+        LookupProbe *probes = probePool.data();
+        size_t nextId = 0;
+        size_t inFlight = 0;
+        size_t pageReads = 0, valueReads = 0;
+        int64_t corruptPage = -1;
+
+        // Start the next id that needs a page read in the given probe slot.
+        // Ids the bucket directory rules out are answered straight away.
+        auto startProbe = [&](uint64_t slot) {
+            LookupProbe &probe = probes[slot];
+            while (nextId < ids.size())
+            {
+                probe.idIdx = nextId++;
+                probe.id = ids[probe.idIdx];
+                probe.found = Record();
+                probe.corruptPage = -1;
+                getLookupChains(*snapshot, probe.id, probe.block.blockIdx, probe.splitPage);
+                if (probe.block.blockIdx == -1)
+                {
+                    onResult(probe.idIdx, probe.found);
+                    continue;
+                }
+
+                probe.state = LookupProbe::WAIT_PAGE;
+                issueProbeRead(probe, slot);
+                pageReads++;
+                inFlight++;
+                return;
+            }
+        };
+
+        for (uint64_t slot = 0; slot < numProbes; slot++)
+            startProbe(slot);
+
+        vector<uint64_t> done;
+        while (inFlight > 0)
+        {
+            done.clear();
+            indexIO->waitForReads(done, false);
+            if (heapIO)
+                heapIO->waitForReads(done, false);
+
+            // Nothing ready on either file: sleep on the one with reads pending
+            if (done.empty())
+            {
+                if (pageReads > 0)
+                    indexIO->waitForReads(done, true);
+                else
+                    heapIO->waitForReads(done, true);
+            }
+
+            for (uint64_t slot : done)
+            {
+                LookupProbe &probe = probes[slot];
+                if (probe.state == LookupProbe::WAIT_PAGE)
+                    pageReads--;
+                else
+                    valueReads--;
+
+                resumeProbe(*snapshot, probe);
+
+                if (probe.corruptPage != -1)
+                {
+                    // Stop starting lookups, but let the reads in flight land
+                    // before the buffers they fill go away
+                    corruptPage = probe.corruptPage;
+                    nextId = ids.size();
+                    inFlight--;
+                }
+                else if (probe.state == LookupProbe::DONE)
+                {
+                    onResult(probe.idIdx, probe.found);
+                    inFlight--;
+                    if (nextId < ids.size())
+                        startProbe(slot);
+                }
+                else
+                {
+                    issueProbeRead(probe, slot);
+                    if (probe.state == LookupProbe::WAIT_PAGE)
+                        pageReads++;
+                    else
+                        valueReads++;
+                }
+            }
+        }
+
+        if (corruptPage != -1)
+        {
+            throw runtime_error("Page " + to_string(corruptPage) + " of " + fName + " failed its checksum");
+        }
+    }
+
+    // Look up many ids at once through the lookup pipeline. Ids that are not
+    // found come back as an empty Record (id -1).
+    vector<Record> findRecordsByIds(const vector<int64_t> &ids, uint32_t fields = Record::ALL_FIELDS)
+    {
+        vector<Record> results(ids.size());
+        lookupPipelined(
+            ids,
+            [&results](size_t k, Record &found) {
+                results[k] = found;
+            },
+            256, fields);
+        return results;
+    }
+
+    // The index as lookups see it now, for scans spread over several threads
+    // that must all see the same state. Null before the index is created.
+    shared_ptr<const IndexSnapshot> currentSnapshot() const
+    {
+        return atomic_load(&published);
+    }
+
+    // Call visit for every record of buckets [firstBucket, endBucket) of the
+    // snapshot, in chain order. Records still on the old chain of a split in
+    // progress come with their new bucket. The Record passed to visit is
+    // reused for the next one. Several scans may run at once, alongside
+    // lookups and inserts.
+    void scanBuckets(const IndexSnapshot &snapshot, int64_t firstBucket, int64_t endBucket,
+                     const function<void(Record &)> &visit)
+    {
+        Block block(-1, options, Block::UNREAD);
+        Record record;
+        vector<int64_t> bucketIds;
+
+        for (int64_t bucketIdx = firstBucket; bucketIdx < endBucket; bucketIdx++)
         {
-            Block currBlock(pgIdx);
-            currBlock.readBlock(indexFile);
+            int64_t splitPgIdx = getSplitChainPage(snapshot, bucketIdx);
+            bucketIds.clear();
 
-            for (int i = 0; i < currBlock.numRecords; i++)
+            for (int64_t pgIdx = snapshot.buckets[bucketIdx].headPage; pgIdx != -1;
+                 pgIdx = snapshot.pages[pgIdx].nextPage)
             {
-                if (currBlock.records[i].id == id)
-                    return currBlock.records[i];
+                block.blockIdx = pgIdx;
+                fetchBlock(snapshot, block);
+                for (int slot = 0; slot < block.numRecords; slot++)
+                {
+                    block.getRecord(slot, record);
+                    if (splitPgIdx != -1)
+                        bucketIds.push_back(record.id);
+                    if (options.separateValueHeap)
+                        readFromValueHeap(snapshot, record, *heapIO);
+                    finishFoundRecord(record);
+                    visit(record);
+                }
             }
-            cout << "Record not found";
+            if (splitPgIdx == -1)
+                continue;
 
-            pgIdx = currBlock.overflowPtrIdx;
+            // A record moved already is found in the bucket first, as a
+            // lookup would
+            sort(bucketIds.begin(), bucketIds.end());
+            for (int64_t pgIdx = splitPgIdx; pgIdx != -1; pgIdx = snapshot.pages[pgIdx].nextPage)
+            {
+                block.blockIdx = pgIdx;
+                fetchBlock(snapshot, block);
+                for (int slot = 0; slot < block.numRecords; slot++)
+                {
+                    int64_t id = block.getKey(slot);
+                    if (bucketFor(id, snapshot.level, snapshot.splitPointer) != bucketIdx ||
+                        binary_search(bucketIds.begin(), bucketIds.end(), id))
+                        continue;
+                    block.getRecord(slot, record);
+                    if (options.separateValueHeap)
+                        readFromValueHeap(snapshot, record, *heapIO);
+                    finishFoundRecord(record);
+                    visit(record);
+                }
+            }
         }
-        indexFile.close();
     }
-};
\ No newline at end of file
+};
+
+#endif
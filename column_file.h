@@ -0,0 +1,654 @@
+#ifndef COLUMN_FILE_H
+#define COLUMN_FILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <unordered_map>
+#include <cstring>
+#include <cstdint>
+#include "classes.h"
+using namespace std;
+
+// Columnar copy of an index for analytics. The records are split into row
+// groups, and each row group stores id, manager_id, name and bio as separate
+// column chunks, so a report reads only the columns it needs.
+//
+// File layout, fixed-size integers little-endian whatever the host:
+//   [magic:uint32][version:uint32]
+//   column chunks, row groups in any order
+//   footer:
+//     [numColumns:uint32], per column [type:uint8][name:string]
+//     [numRowGroups:uint32], per row group [numRows:uint64] and per column
+//     [offset:uint64][length:uint64][encoding:uint8][crc32c:uint32]
+//   [footerLength:uint32][magic:uint32]
+// Strings are a varint length followed by the bytes.
+//
+// Each chunk uses whichever encoding is smallest:
+//   PLAIN:      int64s as 8 bytes each, strings one after another
+//   RLE:        runs of equal values as [count:varint][value]
+//   DICTIONARY: [size:varint], the distinct values, then one varint index
+//               per row
+//   VARINT:     int64s only, one zigzag varint each
+// Integer values in RLE and DICTIONARY chunks are zigzag varints.
+class ColumnFile
+{
+public:
+    static const uint32_t MAGIC = 0x4643484C; // "LHCF"
+    static const uint32_t VERSION = 1;
+
+    enum ColumnType : uint8_t
+    {
+        INT64 = 0,
+        STRING = 1
+    };
+
+    enum Encoding : uint8_t
+    {
+        PLAIN = 0,
+        RLE = 1,
+        DICTIONARY = 2,
+        VARINT = 3
+    };
+
+    // The columns of an exported index, in file order
+    enum Column
+    {
+        ID = 0,
+        MANAGER_ID = 1,
+        NAME = 2,
+        BIO = 3,
+        NUM_COLUMNS = 4
+    };
+
+    struct ChunkInfo
+    {
+        uint64_t offset;
+        uint64_t length;
+        Encoding encoding;
+        uint32_t checksum;
+    };
+
+    struct RowGroupInfo
+    {
+        uint64_t numRows;
+        ChunkInfo chunks[NUM_COLUMNS];
+    };
+
+    // Builds a chunk or the footer
+    class Writer
+    {
+    public:
+        string out;
+
+        // Little-endian, whatever the host
+        template <typename T>
+        void put(T value)
+        {
+            uint64_t bits = (uint64_t)value;
+            for (size_t b = 0; b < sizeof(value); b++)
+                out += (char)(bits >> (8 * b));
+        }
+
+        void putVarint(uint64_t value)
+        {
+            while (value >= 0x80)
+            {
+                out += (char)(value | 0x80);
+                value >>= 7;
+            }
+            out += (char)value;
+        }
+
+        // Small magnitudes of either sign take few bytes
+        void putSigned(int64_t value)
+        {
+            putVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+        }
+
+        void putString(const string &value)
+        {
+            putVarint(value.length());
+            out += value;
+        }
+
+        void putValue(int64_t value)
+        {
+            putSigned(value);
+        }
+
+        void putValue(const string &value)
+        {
+            putString(value);
+        }
+    };
+
+    // Parses a chunk or the footer; throws once the bytes run out
+    class Reader
+    {
+    private:
+        const char *pos;
+        const char *end;
+
+        void need(size_t len)
+        {
+            if ((size_t)(end - pos) < len)
+                throw runtime_error("Column file is truncated or corrupt");
+        }
+
+    public:
+        Reader(const char *data, size_t len) : pos(data), end(data + len)
+        {
+        }
+
+        bool atEnd() const
+        {
+            return pos == end;
+        }
+
+        // Little-endian, whatever the host
+        template <typename T>
+        T get()
+        {
+            need(sizeof(T));
+            uint64_t bits = 0;
+            for (size_t b = 0; b < sizeof(T); b++)
+                bits |= (uint64_t)(uint8_t)pos[b] << (8 * b);
+            pos += sizeof(T);
+            return (T)bits;
+        }
+
+        uint64_t getVarint()
+        {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                need(1);
+                uint8_t byte = *pos++;
+                value |= (uint64_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                    return value;
+            }
+            throw runtime_error("Column file is truncated or corrupt");
+        }
+
+        int64_t getSigned()
+        {
+            uint64_t value = getVarint();
+            return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        }
+
+        string getString()
+        {
+            uint64_t len = getVarint();
+            need(len);
+            string value(pos, len);
+            pos += len;
+            return value;
+        }
+
+        void getValue(int64_t &value)
+        {
+            value = getSigned();
+        }
+
+        void getValue(string &value)
+        {
+            value = getString();
+        }
+    };
+
+private:
+    static void putPlain(Writer &out, const vector<int64_t> &values)
+    {
+        for (int64_t value : values)
+            out.put(value);
+    }
+
+    static void putPlain(Writer &out, const vector<string> &values)
+    {
+        for (const string &value : values)
+            out.putString(value);
+    }
+
+    static void getPlain(Reader &in, vector<int64_t> &values, uint64_t numRows)
+    {
+        for (uint64_t k = 0; k < numRows; k++)
+            values.push_back(in.get<int64_t>());
+    }
+
+    static void getPlain(Reader &in, vector<string> &values, uint64_t numRows)
+    {
+        for (uint64_t k = 0; k < numRows; k++)
+            values.push_back(in.getString());
+    }
+
+    static bool putVarints(Writer &out, const vector<int64_t> &values)
+    {
+        for (int64_t value : values)
+            out.putSigned(value);
+        return true;
+    }
+
+    static bool putVarints(Writer &, const vector<string> &)
+    {
+        return false;
+    }
+
+    static void getVarints(Reader &in, vector<int64_t> &values, uint64_t numRows)
+    {
+        for (uint64_t k = 0; k < numRows; k++)
+            values.push_back(in.getSigned());
+    }
+
+    static void getVarints(Reader &, vector<string> &, uint64_t)
+    {
+        throw runtime_error("Column file is truncated or corrupt");
+    }
+
+    template <typename T>
+    static void putRle(Writer &out, const vector<T> &values)
+    {
+        for (size_t k = 0; k < values.size();)
+        {
+            size_t run = 1;
+            while (k + run < values.size() && values[k + run] == values[k])
+                run++;
+            out.putVarint(run);
+            out.putValue(values[k]);
+            k += run;
+        }
+    }
+
+    // Fails once more than half the values are distinct, as the dictionary
+    // would then hardly be smaller than the values themselves
+    template <typename T>
+    static bool putDictionary(Writer &out, const vector<T> &values)
+    {
+        unordered_map<T, uint64_t> indexes;
+        vector<const T *> distinct;
+        vector<uint64_t> rowIndexes;
+        rowIndexes.reserve(values.size());
+        for (const T &value : values)
+        {
+            auto inserted = indexes.insert(make_pair(value, (uint64_t)distinct.size()));
+            if (inserted.second)
+            {
+                distinct.push_back(&value);
+                if (distinct.size() > values.size() / 2)
+                    return false;
+            }
+            rowIndexes.push_back(inserted.first->second);
+        }
+
+        out.putVarint(distinct.size());
+        for (const T *value : distinct)
+            out.putValue(*value);
+        for (uint64_t index : rowIndexes)
+            out.putVarint(index);
+        return true;
+    }
+
+public:
+    // Encode a column chunk in the smallest of the encodings
+    template <typename T>
+    static string encodeChunk(const vector<T> &values, Encoding &encoding)
+    {
+        Writer best;
+        putPlain(best, values);
+        encoding = PLAIN;
+
+        Writer varints;
+        if (putVarints(varints, values) && varints.out.length() < best.out.length())
+        {
+            best.out.swap(varints.out);
+            encoding = VARINT;
+        }
+
+        Writer rle;
+        putRle(rle, values);
+        if (rle.out.length() < best.out.length())
+        {
+            best.out.swap(rle.out);
+            encoding = RLE;
+        }
+
+        Writer dictionary;
+        if (putDictionary(dictionary, values) && dictionary.out.length() < best.out.length())
+        {
+            best.out.swap(dictionary.out);
+            encoding = DICTIONARY;
+        }
+        return best.out;
+    }
+
+    template <typename T>
+    static vector<T> decodeChunk(const char *data, size_t len, Encoding encoding, uint64_t numRows)
+    {
+        Reader in(data, len);
+        vector<T> values;
+        values.reserve(numRows);
+        if (encoding == PLAIN)
+        {
+            getPlain(in, values, numRows);
+        }
+        else if (encoding == VARINT)
+        {
+            getVarints(in, values, numRows);
+        }
+        else if (encoding == RLE)
+        {
+            while (values.size() < numRows)
+            {
+                uint64_t run = in.getVarint();
+                T value;
+                in.getValue(value);
+                if (run == 0 || run > numRows - values.size())
+                    throw runtime_error("Column file is truncated or corrupt");
+                values.insert(values.end(), run, value);
+            }
+        }
+        else if (encoding == DICTIONARY)
+        {
+            vector<T> distinct(in.getVarint());
+            for (T &value : distinct)
+                in.getValue(value);
+            for (uint64_t k = 0; k < numRows; k++)
+            {
+                uint64_t index = in.getVarint();
+                if (index >= distinct.size())
+                    throw runtime_error("Column file is truncated or corrupt");
+                values.push_back(distinct[index]);
+            }
+        }
+        else
+        {
+            throw runtime_error("Unknown column encoding " + to_string(encoding));
+        }
+        if (!in.atEnd())
+            throw runtime_error("Column file is truncated or corrupt");
+        return values;
+    }
+
+    static const char *columnName(int column)
+    {
+        static const char *names[NUM_COLUMNS] = {"id", "manager_id", "name", "bio"};
+        return names[column];
+    }
+
+    static ColumnType columnType(int column)
+    {
+        return column == ID || column == MANAGER_ID ? INT64 : STRING;
+    }
+};
+
+// Writes every record of an index to a column file. Row groups cover runs of
+// whole buckets and are scanned and encoded on several threads at once, all
+// from the same snapshot of the index, so inserts may continue meanwhile.
+class ColumnExport
+{
+private:
+    // Rows a row group is filled up to, going by the directory's counts
+    static const int64_t ROW_GROUP_ROWS = 65536;
+
+    // Split the buckets into runs holding about ROW_GROUP_ROWS records
+    static vector<pair<int64_t, int64_t>> rowGroupBuckets(const IndexSnapshot &snapshot)
+    {
+        vector<pair<int64_t, int64_t>> groups;
+        int64_t first = 0, rows = 0;
+        for (int64_t bucketIdx = 0; bucketIdx < snapshot.numBuckets; bucketIdx++)
+        {
+            rows += snapshot.buckets[bucketIdx].numRecords;
+            if (rows >= ROW_GROUP_ROWS)
+            {
+                groups.push_back(make_pair(first, bucketIdx + 1));
+                first = bucketIdx + 1;
+                rows = 0;
+            }
+        }
+        if (first < snapshot.numBuckets)
+            groups.push_back(make_pair(first, snapshot.numBuckets));
+        return groups;
+    }
+
+    static void writeFooter(FileIO &out, uint64_t offset, const vector<ColumnFile::RowGroupInfo> &rowGroups)
+    {
+        ColumnFile::Writer footer;
+        footer.put((uint32_t)ColumnFile::NUM_COLUMNS);
+        for (int column = 0; column < ColumnFile::NUM_COLUMNS; column++)
+        {
+            footer.put((uint8_t)ColumnFile::columnType(column));
+            footer.putString(ColumnFile::columnName(column));
+        }
+        footer.put((uint32_t)rowGroups.size());
+        for (const ColumnFile::RowGroupInfo &rowGroup : rowGroups)
+        {
+            footer.put(rowGroup.numRows);
+            for (const ColumnFile::ChunkInfo &chunk : rowGroup.chunks)
+            {
+                footer.put(chunk.offset);
+                footer.put(chunk.length);
+                footer.put((uint8_t)chunk.encoding);
+                footer.put(chunk.checksum);
+            }
+        }
+        footer.put((uint32_t)footer.out.length());
+        footer.put(ColumnFile::MAGIC);
+        out.write(offset, footer.out.data(), footer.out.length());
+    }
+
+public:
+    // Export the index as it is now to path using numThreads threads.
+    // Returns the number of rows written.
+    static int64_t run(LinearHashIndex &index, const string &path, int numThreads)
+    {
+        shared_ptr<const IndexSnapshot> snapshot = index.currentSnapshot();
+        if (!snapshot)
+            throw logic_error("Index has not been created");
+
+        vector<pair<int64_t, int64_t>> groups = rowGroupBuckets(*snapshot);
+        vector<ColumnFile::RowGroupInfo> rowGroups(groups.size());
+
+        unique_ptr<FileIO> out = openFileIO(path, true, false);
+        ColumnFile::Writer fileHeader;
+        fileHeader.put(ColumnFile::MAGIC);
+        fileHeader.put(ColumnFile::VERSION);
+        out->write(0, fileHeader.out.data(), fileHeader.out.length());
+
+        mutex endLock;
+        uint64_t fileEnd = fileHeader.out.length();
+        atomic<size_t> nextGroup(0);
+
+        // Each thread takes the next row group, scans and encodes it, then
+        // reserves room for it at the end of the file
+        auto exportGroups = [&]() {
+            vector<int64_t> ids, managerIds;
+            vector<string> names, bios;
+            for (size_t g = nextGroup++; g < groups.size(); g = nextGroup++)
+            {
+                ids.clear();
+                managerIds.clear();
+                names.clear();
+                bios.clear();
+                index.scanBuckets(*snapshot, groups[g].first, groups[g].second, [&](Record &record) {
+                    ids.push_back(record.id);
+                    managerIds.push_back(record.manager_id);
+                    names.push_back(record.name);
+                    bios.push_back(record.bio);
+                });
+
+                ColumnFile::RowGroupInfo &rowGroup = rowGroups[g];
+                rowGroup.numRows = ids.size();
+                string chunks[ColumnFile::NUM_COLUMNS];
+                chunks[ColumnFile::ID] = ColumnFile::encodeChunk(ids, rowGroup.chunks[ColumnFile::ID].encoding);
+                chunks[ColumnFile::MANAGER_ID] =
+                    ColumnFile::encodeChunk(managerIds, rowGroup.chunks[ColumnFile::MANAGER_ID].encoding);
+                chunks[ColumnFile::NAME] = ColumnFile::encodeChunk(names, rowGroup.chunks[ColumnFile::NAME].encoding);
+                chunks[ColumnFile::BIO] = ColumnFile::encodeChunk(bios, rowGroup.chunks[ColumnFile::BIO].encoding);
+
+                uint64_t offset;
+                uint64_t groupSize = 0;
+                for (const string &chunk : chunks)
+                    groupSize += chunk.length();
+                {
+                    lock_guard<mutex> lock(endLock);
+                    offset = fileEnd;
+                    fileEnd += groupSize;
+                }
+                for (int column = 0; column < ColumnFile::NUM_COLUMNS; column++)
+                {
+                    ColumnFile::ChunkInfo &chunk = rowGroup.chunks[column];
+                    chunk.offset = offset;
+                    chunk.length = chunks[column].length();
+                    chunk.checksum = Crc32c::compute(chunks[column].data(), chunks[column].length());
+                    out->write(offset, chunks[column].data(), chunks[column].length());
+                    offset += chunk.length;
+                }
+            }
+        };
+
+        vector<exception_ptr> errors(max(numThreads, 1));
+        vector<thread> workers;
+        for (size_t t = 0; t < errors.size(); t++)
+        {
+            workers.emplace_back([&exportGroups, &errors, &nextGroup, &groups, t]() {
+                try
+                {
+                    exportGroups();
+                }
+                catch (...)
+                {
+                    errors[t] = current_exception();
+                    nextGroup = groups.size(); // Stop the other threads early
+                }
+            });
+        }
+        for (thread &worker : workers)
+            worker.join();
+        for (exception_ptr &error : errors)
+        {
+            if (error)
+                rethrow_exception(error);
+        }
+
+        writeFooter(*out, fileEnd, rowGroups);
+
+        int64_t numRows = 0;
+        for (const ColumnFile::RowGroupInfo &rowGroup : rowGroups)
+            numRows += rowGroup.numRows;
+        return numRows;
+    }
+};
+
+// Reads a column file written by ColumnExport, one column chunk at a time
+class ColumnFileReader
+{
+private:
+    unique_ptr<FileIO> file;
+    vector<ColumnFile::RowGroupInfo> rowGroups;
+
+    string readChunk(size_t rowGroup, int column)
+    {
+        const ColumnFile::ChunkInfo &chunk = rowGroups.at(rowGroup).chunks[column];
+        string data(chunk.length, '\0');
+        file->read(chunk.offset, &data[0], chunk.length);
+        if (Crc32c::compute(data.data(), data.length()) != chunk.checksum)
+            throw runtime_error("Column " + string(ColumnFile::columnName(column)) + " of row group " +
+                                to_string(rowGroup) + " failed its checksum");
+        return data;
+    }
+
+public:
+    ColumnFileReader(const string &path)
+    {
+        file = openFileIO(path, false, false, true);
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || st.st_size < 16)
+            throw runtime_error(path + " is not a column file");
+
+        char tail[8];
+        file->read(st.st_size - sizeof(tail), tail, sizeof(tail));
+        ColumnFile::Reader tailIn(tail, sizeof(tail));
+        uint32_t footerLength = tailIn.get<uint32_t>();
+        if (tailIn.get<uint32_t>() != ColumnFile::MAGIC || (int64_t)footerLength > st.st_size - 16)
+            throw runtime_error(path + " is not a column file");
+
+        char head[8];
+        file->read(0, head, sizeof(head));
+        ColumnFile::Reader headIn(head, sizeof(head));
+        if (headIn.get<uint32_t>() != ColumnFile::MAGIC)
+            throw runtime_error(path + " is not a column file");
+        if (headIn.get<uint32_t>() != ColumnFile::VERSION)
+            throw runtime_error("Unsupported column file version");
+
+        string footer(footerLength, '\0');
+        file->read(st.st_size - sizeof(tail) - footerLength, &footer[0], footerLength);
+        ColumnFile::Reader in(footer.data(), footer.length());
+        if (in.get<uint32_t>() != ColumnFile::NUM_COLUMNS)
+            throw runtime_error(path + " has different columns");
+        for (int column = 0; column < ColumnFile::NUM_COLUMNS; column++)
+        {
+            if (in.get<uint8_t>() != ColumnFile::columnType(column) || in.getString() != ColumnFile::columnName(column))
+                throw runtime_error(path + " has different columns");
+        }
+
+        rowGroups.resize(in.get<uint32_t>());
+        for (ColumnFile::RowGroupInfo &rowGroup : rowGroups)
+        {
+            rowGroup.numRows = in.get<uint64_t>();
+            for (ColumnFile::ChunkInfo &chunk : rowGroup.chunks)
+            {
+                chunk.offset = in.get<uint64_t>();
+                chunk.length = in.get<uint64_t>();
+                chunk.encoding = (ColumnFile::Encoding)in.get<uint8_t>();
+                chunk.checksum = in.get<uint32_t>();
+            }
+        }
+    }
+
+    size_t numRowGroups() const
+    {
+        return rowGroups.size();
+    }
+
+    uint64_t numRows(size_t rowGroup) const
+    {
+        return rowGroups.at(rowGroup).numRows;
+    }
+
+    // Encoding and size of one column chunk
+    const ColumnFile::ChunkInfo &chunkInfo(size_t rowGroup, int column) const
+    {
+        return rowGroups.at(rowGroup).chunks[column];
+    }
+
+    // Values of an INT64 column (id, manager_id) in one row group
+    vector<int64_t> readInts(size_t rowGroup, int column)
+    {
+        if (ColumnFile::columnType(column) != ColumnFile::INT64)
+            throw invalid_argument(string(ColumnFile::columnName(column)) + " is not an integer column");
+        string data = readChunk(rowGroup, column);
+        const ColumnFile::ChunkInfo &chunk = rowGroups[rowGroup].chunks[column];
+        return ColumnFile::decodeChunk<int64_t>(data.data(), data.length(), chunk.encoding,
+                                                rowGroups[rowGroup].numRows);
+    }
+
+    // Values of a STRING column (name, bio) in one row group
+    vector<string> readStrings(size_t rowGroup, int column)
+    {
+        if (ColumnFile::columnType(column) != ColumnFile::STRING)
+            throw invalid_argument(string(ColumnFile::columnName(column)) + " is not a string column");
+        string data = readChunk(rowGroup, column);
+        const ColumnFile::ChunkInfo &chunk = rowGroups[rowGroup].chunks[column];
+        return ColumnFile::decodeChunk<string>(data.data(), data.length(), chunk.encoding,
+                                               rowGroups[rowGroup].numRows);
+    }
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#else
+#define CRC32C_X86 0
+#endif
+
+using namespace std;
+
+// CRC-32C (Castagnoli), the checksum iSCSI and ext4 use. Runs the SSE4.2
+// crc32 instruction on three interleaved streams when the CPU has it, since
+// one stream waits on the instruction's latency, and a slicing-by-8 table
+// otherwise.
+class Crc32c
+{
+private:
+    static const uint32_t POLYNOMIAL = 0x82F63B78; // Bit-reflected
+
+    // Bytes each of the three streams covers per round
+    static const size_t STREAM_BYTES = 1344;
+
+    struct Tables
+    {
+        // slice[k][b]: the CRC of byte b followed by k zero bytes
+        uint32_t slice[8][256];
+
+        // shift[k][b]: byte k of a CRC being b, carried over STREAM_BYTES
+        // zero bytes. Used to join the CRCs of the three streams.
+        uint32_t shift[4][256];
+
+        Tables()
+        {
+            for (uint32_t b = 0; b < 256; b++)
+            {
+                uint32_t crc = b;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (crc >> 1) ^ (POLYNOMIAL & (0 - (crc & 1)));
+                slice[0][b] = crc;
+            }
+            for (uint32_t b = 0; b < 256; b++)
+            {
+                for (int k = 1; k < 8; k++)
+                    slice[k][b] = (slice[k - 1][b] >> 8) ^ slice[0][slice[k - 1][b] & 0xFF];
+            }
+
+            // Carrying a CRC over zero bytes is linear, so carry each bit once
+            // and combine
+            uint32_t carried[32];
+            for (int bit = 0; bit < 32; bit++)
+            {
+                uint32_t crc = (uint32_t)1 << bit;
+                for (size_t n = 0; n < STREAM_BYTES; n++)
+                    crc = (crc >> 8) ^ slice[0][crc & 0xFF];
+                carried[bit] = crc;
+            }
+            for (int k = 0; k < 4; k++)
+            {
+                for (uint32_t b = 0; b < 256; b++)
+                {
+                    uint32_t crc = 0;
+                    for (int bit = 0; bit < 8; bit++)
+                    {
+                        if (b & (1 << bit))
+                            crc ^= carried[k * 8 + bit];
+                    }
+                    shift[k][b] = crc;
+                }
+            }
+        }
+    };
+
+    static const Tables &tables()
+    {
+        static const Tables t;
+        return t;
+    }
+
+    static uint32_t shiftStream(const Tables &t, uint32_t crc)
+    {
+        return t.shift[0][crc & 0xFF] ^ t.shift[1][(crc >> 8) & 0xFF] ^ t.shift[2][(crc >> 16) & 0xFF] ^
+               t.shift[3][crc >> 24];
+    }
+
+    static uint32_t extendSoftware(uint32_t crc, const char *data, size_t len)
+    {
+        const Tables &t = tables();
+        for (; len >= 8; data += 8, len -= 8)
+        {
+            uint64_t word;
+            memcpy(&word, data, sizeof(word));
+            word ^= crc;
+            crc = t.slice[7][word & 0xFF] ^ t.slice[6][(word >> 8) & 0xFF] ^ t.slice[5][(word >> 16) & 0xFF] ^
+                  t.slice[4][(word >> 24) & 0xFF] ^ t.slice[3][(word >> 32) & 0xFF] ^
+                  t.slice[2][(word >> 40) & 0xFF] ^ t.slice[1][(word >> 48) & 0xFF] ^ t.slice[0][word >> 56];
+        }
+        for (; len > 0; data++, len--)
+            crc = (crc >> 8) ^ t.slice[0][(crc ^ (unsigned char)*data) & 0xFF];
+        return crc;
+    }
+
+#if CRC32C_X86
+    __attribute__((target("sse4.2"))) static uint32_t extendHardware(uint32_t crc, const char *data, size_t len)
+    {
+        uint64_t crc0 = crc;
+        if (len >= 3 * STREAM_BYTES)
+        {
+            const Tables &t = tables();
+            do
+            {
+                uint64_t crc1 = 0, crc2 = 0;
+                for (const char *end = data + STREAM_BYTES; data < end; data += 8)
+                {
+                    uint64_t word0, word1, word2;
+                    memcpy(&word0, data, sizeof(word0));
+                    memcpy(&word1, data + STREAM_BYTES, sizeof(word1));
+                    memcpy(&word2, data + 2 * STREAM_BYTES, sizeof(word2));
+                    crc0 = _mm_crc32_u64(crc0, word0);
+                    crc1 = _mm_crc32_u64(crc1, word1);
+                    crc2 = _mm_crc32_u64(crc2, word2);
+                }
+                crc0 = shiftStream(t, crc0) ^ crc1;
+                crc0 = shiftStream(t, crc0) ^ crc2;
+                data += 2 * STREAM_BYTES;
+                len -= 3 * STREAM_BYTES;
+            } while (len >= 3 * STREAM_BYTES);
+        }
+
+        for (; len >= 8; data += 8, len -= 8)
+        {
+            uint64_t word;
+            memcpy(&word, data, sizeof(word));
+            crc0 = _mm_crc32_u64(crc0, word);
+        }
+        for (; len > 0; data++, len--)
+            crc0 = _mm_crc32_u8(crc0, *data);
+        return crc0;
+    }
+#endif
+
+public:
+    static uint32_t compute(const char *data, size_t len)
+    {
+#if CRC32C_X86
+        static const bool hasSse42 = __builtin_cpu_supports("sse4.2");
+        if (hasSse42)
+            return ~extendHardware(~(uint32_t)0, data, len);
+#endif
+        return ~extendSoftware(~(uint32_t)0, data, len);
+    }
+
+    // The table-driven version, whatever the CPU
+    static uint32_t computeSoftware(const char *data, size_t len)
+    {
+        return ~extendSoftware(~(uint32_t)0, data, len);
+    }
+};
+
+#endif
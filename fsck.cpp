@@ -0,0 +1,810 @@
+/*
+Check an index file, for example after the process died during createFromFile
+or insert, and rebuild its bucket directory, free-space map and header
+counters from the pages.
+
+Usage: Assignment3_Fsck [--repair] [--threads N] <index file>
+
+The pages are scanned in parallel ranges and classified by their checksum and
+header. Chains are rebuilt from the pages' overflow pointers and matched to
+buckets by the keys they hold, then compared with the header,
+<index>.dir and <index>.fsm. Pages no chain reaches are reported as
+orphaned. With --repair those three files are rewritten from the rebuilt
+chains, unless records have been lost.
+
+Exit status: 0 the index is consistent, 1 problems were found (and repaired
+with --repair), 2 records were lost and the index must be rebuilt.
+*/
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
+#include <thread>
+#include <cstring>
+#include <sys/stat.h>
+#include "classes.h"
+using namespace std;
+
+static const int PAGE_SIZE = Block::PAGE_SIZE;
+
+// Problems of one kind to show before only counting the rest
+static const size_t MAX_EXAMPLES = 10;
+
+enum PageKind {
+    PAGE_CHAIN,  // Passes its checksum and header checks
+    PAGE_FREE,   // Freed and overwritten with '*'
+    PAGE_BLANK,  // Never written
+    PAGE_CORRUPT // Fails its checksum or has an impossible header
+};
+
+struct PageInfo {
+    PageKind kind = PAGE_BLANK;
+    int64_t next = -1; // Overflow pointer as stored in the page
+    int blockSize = 0;
+    vector<int64_t> keys;
+    int64_t badValues = 0; // Records whose value lies past the end of the value heap
+};
+
+struct Chain {
+    vector<int64_t> pages;
+    int64_t numRecords = 0;
+};
+
+// Chains assigned to the buckets of one linear hashing state
+struct Layout {
+    int level = 0;
+    int64_t splitPointer = 0;
+    int64_t numBuckets = 0;
+    vector<int64_t> bucketChain; // Chain of each bucket, -1 for none
+    int64_t splitChain = -1;     // Old chain of a split in progress
+    bool splitFromHeader = false; // It starts where the header says the split has got to
+    int64_t splitSource = -1;
+    vector<int64_t> staleChains; // Orphaned copies of records kept elsewhere
+    vector<pair<int64_t, int64_t>> cutChains; // (bucket, chain) cut off from the bucket's chain
+    vector<int64_t> lostChains;  // Orphaned chains with keys of several buckets
+    int64_t lostRecords = 0;
+};
+
+// Problems of one kind: the first few in full, the rest counted
+struct Problems {
+    string title;
+    vector<string> examples;
+    int64_t count = 0;
+
+    Problems(const string &problemTitle) : title(problemTitle)
+    {
+    }
+
+    void add(const string &message)
+    {
+        if (examples.size() < MAX_EXAMPLES)
+            examples.push_back(message);
+        count++;
+    }
+
+    void print() const
+    {
+        if (count == 0)
+            return;
+        cout << "  " << title << ": " << count << endl;
+        for (const string &message : examples)
+            cout << "    " << message << endl;
+        if (count > (int64_t)examples.size())
+            cout << "    ... and " << count - examples.size() << " more" << endl;
+    }
+};
+
+static int64_t fileSize(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+static void classifyPage(const char *page, Block &block, int64_t heapSize, const IndexOptions &format, PageInfo &info)
+{
+    static const string freeMarker(PAGE_SIZE, '*');
+    static const string blankPage(PAGE_SIZE, '\0');
+
+    if (memcmp(page, freeMarker.data(), PAGE_SIZE) == 0) {
+        info.kind = PAGE_FREE;
+        return;
+    }
+    if (memcmp(page, blankPage.data(), PAGE_SIZE) == 0) {
+        info.kind = PAGE_BLANK;
+        return;
+    }
+
+    block.attach(page);
+    int arraysEnd = Block::HEADER_SIZE + block.numRecords * (format.keyWidth + (int)sizeof(uint16_t));
+    if (!block.checksumMatches() || block.payloadStart > PAGE_SIZE || arraysEnd > block.payloadStart) {
+        info.kind = PAGE_CORRUPT;
+        return;
+    }
+
+    info.kind = PAGE_CHAIN;
+    info.next = block.overflowPtrIdx;
+    info.blockSize = block.blockSize;
+    Record record;
+    for (int slot = 0; slot < block.numRecords; slot++) {
+        info.keys.push_back(block.getKey(slot));
+        if (format.separateValueHeap) {
+            block.getRecord(slot, record);
+            if (record.valueOffset < 0 || record.valueOffset + record.valueLength > heapSize)
+                info.badValues++;
+        }
+    }
+}
+
+// Read and classify every page but the header, each thread taking one
+// contiguous range so the reads stay sequential
+static vector<PageInfo> scanPages(FileIO &indexFile, int64_t numPages, int64_t heapSize, const IndexOptions &format,
+                                  int numThreads)
+{
+    const int64_t PAGES_PER_READ = 64;
+
+    vector<PageInfo> pages(numPages);
+    int64_t perThread = (numPages + numThreads - 1) / numThreads;
+    vector<thread> workers;
+    for (int t = 0; t < numThreads; t++) {
+        int64_t first = max((int64_t)1, t * perThread);
+        int64_t last = min(numPages, (t + 1) * perThread);
+        workers.emplace_back([&, first, last]() {
+            vector<char> buffer(PAGES_PER_READ * PAGE_SIZE);
+            Block block(-1, format, Block::UNREAD);
+            for (int64_t pgIdx = first; pgIdx < last; pgIdx += PAGES_PER_READ) {
+                int64_t count = min(PAGES_PER_READ, last - pgIdx);
+                indexFile.read(pgIdx * PAGE_SIZE, buffer.data(), count * PAGE_SIZE);
+                for (int64_t k = 0; k < count; k++) {
+                    block.blockIdx = pgIdx + k;
+                    classifyPage(&buffer[k * PAGE_SIZE], block, heapSize, format, pages[pgIdx + k]);
+                }
+            }
+        });
+    }
+    for (thread &worker : workers)
+        worker.join();
+    return pages;
+}
+
+// Follow the overflow pointers from every chain page nothing points to, and
+// from the pages in isHead, which start a chain whatever points to them.
+// Pointers to anything but an unvisited chain page end the chain; next holds
+// each chain page's pointer as it should be.
+static vector<Chain> buildChains(const vector<PageInfo> &pages, const vector<bool> &isHead, vector<int64_t> &next)
+{
+    int64_t numPages = pages.size();
+    next.assign(numPages, -1);
+    vector<int> incoming(numPages, 0);
+    for (int64_t pgIdx = 1; pgIdx < numPages; pgIdx++) {
+        const PageInfo &page = pages[pgIdx];
+        if (page.kind != PAGE_CHAIN || page.next == -1)
+            continue;
+        if (page.next < 1 || page.next >= numPages || pages[page.next].kind != PAGE_CHAIN || isHead[page.next])
+            continue;
+        next[pgIdx] = page.next;
+        incoming[page.next]++;
+    }
+
+    vector<Chain> chains;
+    vector<bool> visited(numPages, false);
+    auto walk = [&](int64_t head) {
+        Chain chain;
+        int64_t pgIdx = head;
+        while (true) {
+            visited[pgIdx] = true;
+            chain.pages.push_back(pgIdx);
+            chain.numRecords += pages[pgIdx].keys.size();
+            int64_t nextPgIdx = next[pgIdx];
+            if (nextPgIdx == -1)
+                break;
+            if (visited[nextPgIdx]) {
+                next[pgIdx] = -1;
+                break;
+            }
+            pgIdx = nextPgIdx;
+        }
+        chains.push_back(chain);
+    };
+
+    for (int64_t pgIdx = 1; pgIdx < numPages; pgIdx++) {
+        if (pages[pgIdx].kind == PAGE_CHAIN && incoming[pgIdx] == 0)
+            walk(pgIdx);
+    }
+    // Whatever is left sits on a loop of pointers
+    for (int64_t pgIdx = 1; pgIdx < numPages; pgIdx++) {
+        if (pages[pgIdx].kind == PAGE_CHAIN && !visited[pgIdx])
+            walk(pgIdx);
+    }
+    return chains;
+}
+
+// A page dropped from a chain while a snapshot could still read it keeps its
+// overflow pointer, so it can lead into a live chain. Without the bucket
+// directory to say where chains start, such pages show up as the first pages
+// of a chain whose records all also live in another chain; split them off.
+static void splitStaleHeads(vector<Chain> &chains, const vector<PageInfo> &pages, const vector<bool> &isHead)
+{
+    unordered_map<int64_t, int64_t> firstChain;
+    unordered_set<int64_t> sharedKeys; // Keys in more than one chain
+    for (int64_t c = 0; c < (int64_t)chains.size(); c++) {
+        for (int64_t pgIdx : chains[c].pages) {
+            for (int64_t key : pages[pgIdx].keys) {
+                auto inserted = firstChain.insert(make_pair(key, c));
+                if (!inserted.second && inserted.first->second != c)
+                    sharedKeys.insert(key);
+            }
+        }
+    }
+
+    size_t numChains = chains.size();
+    for (size_t c = 0; c < numChains; c++) {
+        while (chains[c].pages.size() > 1 && !isHead[chains[c].pages[0]]) {
+            const vector<int64_t> &keys = pages[chains[c].pages[0]].keys;
+            bool stale = !keys.empty() && all_of(keys.begin(), keys.end(), [&](int64_t key) {
+                return sharedKeys.count(key) > 0;
+            });
+            if (!stale)
+                break;
+
+            Chain head;
+            head.pages.push_back(chains[c].pages[0]);
+            head.numRecords = keys.size();
+            chains[c].pages.erase(chains[c].pages.begin());
+            chains[c].numRecords -= head.numRecords;
+            chains.push_back(head);
+        }
+    }
+}
+
+// Buckets the keys of a chain hash to, stopping after three
+static vector<int64_t> chainBuckets(const Chain &chain, const vector<PageInfo> &pages, int level, int64_t splitPointer)
+{
+    vector<int64_t> buckets;
+    for (int64_t pgIdx : chain.pages) {
+        for (int64_t key : pages[pgIdx].keys) {
+            int64_t bucketIdx = LinearHashIndex::bucketFor(key, level, splitPointer);
+            if (find(buckets.begin(), buckets.end(), bucketIdx) == buckets.end()) {
+                buckets.push_back(bucketIdx);
+                if (buckets.size() > 2)
+                    return buckets;
+            }
+        }
+    }
+    return buckets;
+}
+
+static unordered_set<int64_t> chainKeys(const Chain &chain, const vector<PageInfo> &pages)
+{
+    unordered_set<int64_t> keys;
+    for (int64_t pgIdx : chain.pages)
+        keys.insert(pages[pgIdx].keys.begin(), pages[pgIdx].keys.end());
+    return keys;
+}
+
+// Assign the chains to the buckets of an index with numBuckets buckets. The
+// chain starting at splitHead, if its keys allow, is the old chain of the
+// split in progress. Otherwise each bucket keeps the chain with the most
+// records. A chain with keys of several buckets is stale if its records are
+// all in those buckets' chains, as for pages a split has drained but a
+// snapshot still held; otherwise it may be the old chain of the split if it
+// holds keys of exactly the pair being split. Another chain of the same
+// bucket is stale if its records are all in the bucket's chain, and may be
+// the old chain of the split if the bucket is one of that pair. Otherwise it
+// was cut off from the bucket's chain.
+// Empty chains go to the bucket headBucket gives for their first page, if
+// any, else to the first bucket still without a chain.
+static Layout assignChains(const vector<Chain> &chains, const vector<PageInfo> &pages, int64_t numBuckets,
+                           int64_t splitHead, const vector<int64_t> &headBucket)
+{
+    Layout layout;
+    layout.numBuckets = numBuckets;
+    while (((int64_t)2 << layout.level) <= numBuckets)
+        layout.level++;
+    layout.splitPointer = numBuckets - ((int64_t)1 << layout.level);
+
+    // The bucket a split in progress would be moving records out of
+    int splitLevel = layout.splitPointer == 0 ? layout.level - 1 : layout.level;
+    int64_t splitSource = numBuckets - 1 - ((int64_t)1 << max(splitLevel, 0));
+    auto inSplitPair = [&](int64_t bucketIdx) {
+        return bucketIdx == splitSource || bucketIdx == numBuckets - 1;
+    };
+
+    layout.bucketChain.assign(numBuckets, -1);
+    vector<vector<int64_t>> candidates(numBuckets);
+    vector<int64_t> emptyChains;
+    vector<int64_t> mixedChains; // Chains with keys of several buckets
+    for (int64_t c = 0; c < (int64_t)chains.size(); c++) {
+        if (chains[c].numRecords == 0) {
+            emptyChains.push_back(c);
+            continue;
+        }
+        vector<int64_t> buckets = chainBuckets(chains[c], pages, layout.level, layout.splitPointer);
+        bool splitKeys = buckets.size() <= 2 && all_of(buckets.begin(), buckets.end(), inSplitPair);
+        if (chains[c].pages[0] == splitHead && splitKeys && layout.splitChain == -1) {
+            layout.splitChain = c;
+            layout.splitFromHeader = true;
+        } else if (buckets.size() == 1 && buckets[0] < numBuckets) {
+            candidates[buckets[0]].push_back(c);
+        } else {
+            mixedChains.push_back(c);
+        }
+    }
+
+    for (int64_t bucketIdx = 0; bucketIdx < numBuckets; bucketIdx++) {
+        vector<int64_t> &bucketChains = candidates[bucketIdx];
+        sort(bucketChains.begin(), bucketChains.end(), [&](int64_t a, int64_t b) {
+            return chains[a].numRecords > chains[b].numRecords;
+        });
+        if (!bucketChains.empty())
+            layout.bucketChain[bucketIdx] = bucketChains[0];
+    }
+
+    // Keys of each bucket's chain, gathered as they are needed
+    unordered_map<int64_t, unordered_set<int64_t>> bucketKeys;
+    auto keysOf = [&](int64_t bucketIdx) -> const unordered_set<int64_t> & {
+        auto found = bucketKeys.find(bucketIdx);
+        if (found == bucketKeys.end()) {
+            unordered_set<int64_t> keys;
+            if (layout.bucketChain[bucketIdx] != -1)
+                keys = chainKeys(chains[layout.bucketChain[bucketIdx]], pages);
+            found = bucketKeys.insert(make_pair(bucketIdx, move(keys))).first;
+        }
+        return found->second;
+    };
+
+    for (int64_t c : mixedChains) {
+        bool inBuckets = true, splitKeys = true;
+        for (int64_t pgIdx : chains[c].pages) {
+            for (int64_t key : pages[pgIdx].keys) {
+                int64_t bucketIdx = LinearHashIndex::bucketFor(key, layout.level, layout.splitPointer);
+                splitKeys = splitKeys && inSplitPair(bucketIdx);
+                inBuckets = inBuckets && bucketIdx < numBuckets && keysOf(bucketIdx).count(key) > 0;
+            }
+        }
+        if (inBuckets) {
+            layout.staleChains.push_back(c);
+        } else if (splitKeys && layout.splitChain == -1) {
+            layout.splitChain = c;
+        } else {
+            layout.lostChains.push_back(c);
+            layout.lostRecords += chains[c].numRecords;
+        }
+    }
+
+    for (int64_t bucketIdx = 0; bucketIdx < numBuckets; bucketIdx++) {
+        const vector<int64_t> &bucketChains = candidates[bucketIdx];
+        if (bucketChains.size() <= 1)
+            continue;
+
+        const unordered_set<int64_t> &kept = keysOf(bucketIdx);
+        for (size_t k = 1; k < bucketChains.size(); k++) {
+            int64_t c = bucketChains[k];
+            int64_t missing = 0;
+            for (int64_t pgIdx : chains[c].pages) {
+                for (int64_t key : pages[pgIdx].keys)
+                    missing += kept.count(key) == 0;
+            }
+            if (missing == 0) {
+                layout.staleChains.push_back(c);
+            } else if (inSplitPair(bucketIdx) && layout.splitChain == -1) {
+                layout.splitChain = c;
+            } else {
+                layout.cutChains.push_back(make_pair(bucketIdx, c));
+            }
+        }
+    }
+    if (layout.splitChain != -1)
+        layout.splitSource = splitSource;
+
+    // Chains without records can only be the whole chain of an empty bucket
+    vector<int64_t> unplaced;
+    for (int64_t c : emptyChains) {
+        int64_t bucketIdx = headBucket[chains[c].pages[0]];
+        if (bucketIdx >= 0 && bucketIdx < numBuckets && layout.bucketChain[bucketIdx] == -1)
+            layout.bucketChain[bucketIdx] = c;
+        else
+            unplaced.push_back(c);
+    }
+    size_t nextEmpty = 0;
+    for (int64_t bucketIdx = 0; bucketIdx < numBuckets && nextEmpty < unplaced.size(); bucketIdx++) {
+        if (layout.bucketChain[bucketIdx] == -1)
+            layout.bucketChain[bucketIdx] = unplaced[nextEmpty++];
+    }
+    for (; nextEmpty < unplaced.size(); nextEmpty++)
+        layout.staleChains.push_back(unplaced[nextEmpty]);
+    return layout;
+}
+
+// Buckets without a chain, which a repair gives a fresh empty page
+static int64_t bucketsWithoutChain(const Layout &layout)
+{
+    return count(layout.bucketChain.begin(), layout.bucketChain.end(), (int64_t)-1);
+}
+
+// Whether layout a explains the chains better than layout b
+static bool betterLayout(const Layout &a, const Layout &b)
+{
+    if (a.lostRecords != b.lostRecords)
+        return a.lostRecords < b.lostRecords;
+    size_t aOrphans = a.staleChains.size() + a.cutChains.size();
+    size_t bOrphans = b.staleChains.size() + b.cutChains.size();
+    if (aOrphans != bOrphans)
+        return aOrphans < bOrphans;
+    return bucketsWithoutChain(a) < bucketsWithoutChain(b);
+}
+
+// The number of buckets comes from the header unless another count near
+// the number of chains explains them better, as after a crash during
+// createFromFile, which only writes the counters at the end. Stale chains
+// alone do not make the header's count doubtful: a writer leaves pages it
+// retired while a snapshot held them behind, empty ones included.
+static Layout chooseLayout(const vector<Chain> &chains, const vector<PageInfo> &pages, const IndexHeader &header,
+                           const vector<int64_t> &headBucket)
+{
+    Layout best;
+    bool haveBest = false;
+    int64_t splitHead = header.splitSourceBucket == -1 ? -1 : header.splitChainPage;
+    if (header.numBuckets >= 2) {
+        best = assignChains(chains, pages, header.numBuckets, splitHead, headBucket);
+        haveBest = true;
+        if (best.lostRecords == 0 && best.cutChains.empty() && bucketsWithoutChain(best) == 0)
+            return best;
+    }
+
+    int64_t numChains = chains.size();
+    for (int64_t numBuckets = max((int64_t)2, numChains - 2); numBuckets <= max((int64_t)2, numChains + 2);
+         numBuckets++) {
+        Layout candidate = assignChains(chains, pages, numBuckets, splitHead, headBucket);
+        if (!haveBest || betterLayout(candidate, best)) {
+            best = candidate;
+            haveBest = true;
+        }
+    }
+    return best;
+}
+
+// Link each chain cut off from its bucket's chain back to the end of it.
+// Lookups walk whole chains, so the order of the pages does not matter.
+static void joinCutChains(Layout &layout, vector<Chain> &chains, vector<int64_t> &next)
+{
+    for (const pair<int64_t, int64_t> &cut : layout.cutChains) {
+        Chain &bucketChain = chains[layout.bucketChain[cut.first]];
+        Chain &cutChain = chains[cut.second];
+        next[bucketChain.pages.back()] = cutChain.pages.front();
+        bucketChain.pages.insert(bucketChain.pages.end(), cutChain.pages.begin(), cutChain.pages.end());
+        bucketChain.numRecords += cutChain.numRecords;
+    }
+}
+
+// Records in the buckets' chains, plus those on the old chain of a split in
+// progress that have not been moved yet. Pages before the one the header
+// names have all been moved, and are not part of the chain that starts there.
+static int64_t countRecords(const Layout &layout, const vector<Chain> &chains, const vector<PageInfo> &pages)
+{
+    int64_t numRecords = 0;
+    for (int64_t c : layout.bucketChain) {
+        if (c != -1)
+            numRecords += chains[c].numRecords;
+    }
+    if (layout.splitChain == -1)
+        return numRecords;
+    if (layout.splitFromHeader)
+        return numRecords + chains[layout.splitChain].numRecords;
+
+    unordered_set<int64_t> moved;
+    for (int64_t bucketIdx : {layout.splitSource, layout.numBuckets - 1}) {
+        if (layout.bucketChain[bucketIdx] != -1) {
+            unordered_set<int64_t> keys = chainKeys(chains[layout.bucketChain[bucketIdx]], pages);
+            moved.insert(keys.begin(), keys.end());
+        }
+    }
+    for (int64_t pgIdx : chains[layout.splitChain].pages) {
+        for (int64_t key : pages[pgIdx].keys)
+            numRecords += moved.count(key) == 0;
+    }
+    return numRecords;
+}
+
+static void repair(const string &indexFName, FileIO &indexFile, IndexHeader &header, vector<PageInfo> &pages,
+                   vector<Chain> &chains, vector<int64_t> &next, Layout &layout, const IndexOptions &format)
+{
+    // Give buckets without a chain a fresh empty page at the end of the file
+    for (int64_t bucketIdx = 0; bucketIdx < layout.numBuckets; bucketIdx++) {
+        if (layout.bucketChain[bucketIdx] != -1)
+            continue;
+        int64_t pgIdx = pages.size();
+        Block empty(pgIdx, format);
+        empty.writeBlock(indexFile);
+
+        PageInfo info;
+        info.kind = PAGE_CHAIN;
+        info.blockSize = Block::HEADER_SIZE;
+        pages.push_back(info);
+        next.push_back(-1);
+        Chain chain;
+        chain.pages.push_back(pgIdx);
+        chains.push_back(chain);
+        layout.bucketChain[bucketIdx] = chains.size() - 1;
+    }
+
+    vector<int64_t> keptChains(layout.bucketChain);
+    if (layout.splitChain != -1)
+        keptChains.push_back(layout.splitChain);
+
+    BucketDirectory directory;
+    FreeSpaceMap freeSpace;
+    int64_t numBlocks = 0, totalSize = 0;
+    for (int64_t pgIdx = 1; pgIdx < (int64_t)pages.size(); pgIdx++) {
+        freeSpace.setFree(pgIdx, 0);
+        freeSpace.setNext(pgIdx, -1);
+    }
+    for (size_t k = 0; k < keptChains.size(); k++) {
+        const Chain &chain = chains[keptChains[k]];
+        bool isBucket = (int64_t)k < layout.numBuckets;
+        for (size_t p = 0; p < chain.pages.size(); p++) {
+            int64_t pgIdx = chain.pages[p];
+            const PageInfo &page = pages[pgIdx];
+
+            // Overflow pointers are not covered by the checksum, so one that
+            // led nowhere is rewritten in place
+            if (page.next != next[pgIdx])
+                indexFile.write(pgIdx * PAGE_SIZE, reinterpret_cast<const char *>(&next[pgIdx]), sizeof(int64_t));
+
+            if (isBucket) {
+                if (p == 0)
+                    directory.addBucket(pgIdx);
+                else
+                    directory.appendPage(k, pgIdx);
+                for (int64_t key : page.keys)
+                    directory.addKey(k, key);
+            }
+            freeSpace.setFree(pgIdx, PAGE_SIZE - page.blockSize);
+            freeSpace.setNext(pgIdx, next[pgIdx]);
+            for (int64_t key : page.keys)
+                freeSpace.addKey(pgIdx, key);
+
+            numBlocks++;
+            totalSize += page.blockSize;
+        }
+    }
+
+    unique_ptr<FileIO> directoryIO = openFileIO(indexFName + ".dir", true, false);
+    directory.persist(*directoryIO);
+    unique_ptr<FileIO> freeSpaceIO = openFileIO(indexFName + ".fsm", true, false);
+    freeSpace.persist(*freeSpaceIO);
+
+    header.level = layout.level;
+    header.splitPointer = layout.splitPointer;
+    header.numBuckets = layout.numBuckets;
+    header.numRecords = countRecords(layout, chains, pages);
+    header.nextFreePage = pages.size();
+    header.numBlocks = numBlocks;
+    header.numOverflowBlocks = numBlocks - layout.numBuckets;
+    header.currentTotalSize = totalSize;
+    header.splitSourceBucket = layout.splitSource;
+    header.splitChainPage = layout.splitChain == -1 ? -1 : chains[layout.splitChain].pages[0];
+    if (header.flags & IndexHeader::FLAG_VALUE_HEAP)
+        header.valueHeapSize = max((int64_t)0, fileSize(indexFName + ".heap"));
+    header.writeHeader(indexFile);
+}
+
+int main(int argc, char *const argv[])
+{
+    bool doRepair = false;
+    int numThreads = max(1u, thread::hardware_concurrency());
+    string indexFName;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--repair")
+            doRepair = true;
+        else if (arg == "--threads" && i + 1 < argc)
+            numThreads = max(1, stoi(argv[++i]));
+        else
+            indexFName = arg;
+    }
+    if (indexFName.empty()) {
+        cerr << "Usage: " << argv[0] << " [--repair] [--threads N] <index file>" << endl;
+        return 2;
+    }
+
+    unique_ptr<FileIO> indexFile;
+    IndexHeader header;
+    try {
+        indexFile = openFileIO(indexFName, false, false, !doRepair);
+        header.readHeader(*indexFile);
+    } catch (const runtime_error &e) {
+        cout << indexFName << ": " << e.what() << endl;
+        cout << "status: unusable, rebuild the index" << endl;
+        return 2;
+    }
+
+    IndexOptions format;
+    format.keyWidth = header.keyWidth;
+    format.separateValueHeap = (header.flags & IndexHeader::FLAG_VALUE_HEAP) != 0;
+    int64_t size = fileSize(indexFName);
+    int64_t numPages = size / PAGE_SIZE;
+    int64_t heapSize = format.separateValueHeap ? fileSize(indexFName + ".heap") : 0;
+
+    cout << indexFName << ": " << numPages << " pages" << endl;
+    cout << "  header: " << header.numBuckets << " buckets, " << header.numRecords << " records, level "
+         << header.level << ", split pointer " << header.splitPointer << endl;
+
+    vector<PageInfo> pages = scanPages(*indexFile, numPages, heapSize, format, numThreads);
+
+    Problems structure{"file and header"};
+    Problems corrupt{"corrupt pages, records on them are lost"};
+    Problems links{"broken links"};
+    Problems cut{"chains cut off from their bucket"};
+    Problems lost{"orphaned chains with keys of several buckets"};
+    Problems stale{"orphaned copies of pages, harmless"};
+    Problems values{"records whose value is past the end of the value heap"};
+    Problems sidecars{"bucket directory and free-space map"};
+
+    if (size % PAGE_SIZE != 0)
+        structure.add("file ends " + to_string(size % PAGE_SIZE) + " bytes into a page");
+    if (header.numBuckets == 0 && numPages > 1)
+        structure.add("counters were never written, createFromFile did not finish");
+
+    int64_t counts[4] = {0, 0, 0, 0};
+    for (int64_t pgIdx = 1; pgIdx < numPages; pgIdx++) {
+        counts[pages[pgIdx].kind]++;
+        if (pages[pgIdx].kind == PAGE_CORRUPT)
+            corrupt.add("page " + to_string(pgIdx));
+        if (pages[pgIdx].badValues > 0)
+            values.add("page " + to_string(pgIdx) + " holds " + to_string(pages[pgIdx].badValues));
+    }
+
+    BucketDirectory directory;
+    FreeSpaceMap freeSpace;
+    bool haveDirectory = false, haveFreeSpace = false;
+    try {
+        unique_ptr<FileIO> directoryIO = openFileIO(indexFName + ".dir", false, false, true);
+        haveDirectory = directory.load(*directoryIO);
+    } catch (const runtime_error &) {
+    }
+    try {
+        unique_ptr<FileIO> freeSpaceIO = openFileIO(indexFName + ".fsm", false, false, true);
+        haveFreeSpace = freeSpace.load(*freeSpaceIO);
+    } catch (const runtime_error &) {
+    }
+
+    // Where chains start, as far as the directory and header still know
+    vector<bool> isHead(numPages, false);
+    vector<int64_t> headBucket(numPages, -1);
+    auto markHead = [&](int64_t pgIdx, int64_t bucketIdx) {
+        if (pgIdx >= 1 && pgIdx < numPages && pages[pgIdx].kind == PAGE_CHAIN) {
+            isHead[pgIdx] = true;
+            headBucket[pgIdx] = bucketIdx;
+        }
+    };
+    if (haveDirectory) {
+        for (int64_t bucketIdx = 0; bucketIdx < directory.size(); bucketIdx++)
+            markHead(directory.headPage(bucketIdx), bucketIdx);
+    }
+    if (header.splitSourceBucket != -1)
+        markHead(header.splitChainPage, -1);
+
+    vector<int64_t> next;
+    vector<Chain> chains = buildChains(pages, isHead, next);
+    splitStaleHeads(chains, pages, isHead);
+    Layout layout = chooseLayout(chains, pages, header, headBucket);
+
+    for (const pair<int64_t, int64_t> &chainCut : layout.cutChains)
+        cut.add("chain from page " + to_string(chains[chainCut.second].pages[0]) + ", " +
+                to_string(chains[chainCut.second].numRecords) + " records of bucket " + to_string(chainCut.first));
+    joinCutChains(layout, chains, next);
+
+    vector<int64_t> keptChains(layout.bucketChain);
+    if (layout.splitChain != -1)
+        keptChains.push_back(layout.splitChain);
+    auto describeLink = [](int64_t nextPgIdx) {
+        return nextPgIdx == -1 ? string("end its chain") : "point to page " + to_string(nextPgIdx);
+    };
+    for (int64_t c : keptChains) {
+        if (c == -1)
+            continue;
+        for (int64_t pgIdx : chains[c].pages) {
+            if (pages[pgIdx].next != next[pgIdx])
+                links.add("page " + to_string(pgIdx) + " should " + describeLink(next[pgIdx]) + ", not " +
+                          describeLink(pages[pgIdx].next));
+        }
+    }
+    for (int64_t c : layout.lostChains)
+        lost.add("chain from page " + to_string(chains[c].pages[0]) + ", " + to_string(chains[c].numRecords) +
+                 " records");
+    for (int64_t c : layout.staleChains) {
+        for (int64_t pgIdx : chains[c].pages)
+            stale.add("page " + to_string(pgIdx));
+    }
+
+    int64_t longest = 0;
+    for (int64_t c : layout.bucketChain) {
+        if (c != -1)
+            longest = max(longest, (int64_t)chains[c].pages.size());
+    }
+    cout << "  pages: " << counts[PAGE_CHAIN] << " in chains, " << counts[PAGE_FREE] << " free, "
+         << counts[PAGE_BLANK] << " blank, " << counts[PAGE_CORRUPT] << " corrupt" << endl;
+    cout << "  rebuilt: " << layout.numBuckets << " buckets, level " << layout.level << ", split pointer "
+         << layout.splitPointer << ", longest chain " << longest << " pages";
+    if (layout.splitChain != -1)
+        cout << ", split of bucket " << layout.splitSource << " in progress";
+    cout << endl;
+
+    if (layout.numBuckets != header.numBuckets || layout.splitPointer != header.splitPointer)
+        structure.add("header counts " + to_string(header.numBuckets) + " buckets, the pages hold " +
+                      to_string(layout.numBuckets));
+    int64_t numRecords = countRecords(layout, chains, pages);
+    if (numRecords != header.numRecords)
+        structure.add("header counts " + to_string(header.numRecords) + " records, the pages hold " +
+                      to_string(numRecords));
+    if (header.nextFreePage > numPages)
+        structure.add("header's next free page " + to_string(header.nextFreePage) + " is past the end of the file");
+
+    // Compare the sidecar files with the rebuilt chains
+    if (!haveDirectory) {
+        sidecars.add("bucket directory is missing or unreadable");
+    } else {
+        for (int64_t bucketIdx = 0; bucketIdx < layout.numBuckets; bucketIdx++) {
+            int64_t c = layout.bucketChain[bucketIdx];
+            if (bucketIdx >= directory.size()) {
+                sidecars.add("bucket " + to_string(bucketIdx) + " is missing from the directory");
+            } else if (c == -1 || directory.headPage(bucketIdx) != chains[c].pages.front() ||
+                       directory.tailPage(bucketIdx) != chains[c].pages.back() ||
+                       directory.chainLength(bucketIdx) != (int64_t)chains[c].pages.size() ||
+                       directory.recordCount(bucketIdx) != chains[c].numRecords) {
+                sidecars.add("directory entry of bucket " + to_string(bucketIdx) + " differs from its chain");
+            }
+        }
+        if (directory.size() > layout.numBuckets)
+            sidecars.add("directory has " + to_string(directory.size() - layout.numBuckets) + " extra buckets");
+    }
+
+    if (!haveFreeSpace) {
+        sidecars.add("free-space map is missing or unreadable");
+    } else {
+        for (int64_t c : keptChains) {
+            if (c == -1)
+                continue;
+            for (int64_t pgIdx : chains[c].pages) {
+                if (pgIdx >= (int64_t)freeSpace.pageLinks().size() || freeSpace.getNext(pgIdx) != next[pgIdx] ||
+                    freeSpace.getFree(pgIdx) != PAGE_SIZE - pages[pgIdx].blockSize)
+                    sidecars.add("free-space entry of page " + to_string(pgIdx) + " differs from the page");
+            }
+        }
+    }
+
+    const Problems *all[] = {&structure, &corrupt, &links, &cut, &lost, &stale, &values, &sidecars};
+    for (const Problems *problems : all)
+        problems->print();
+
+    int64_t lostRecords = layout.lostRecords;
+    bool recordsLost = corrupt.count > 0 || lostRecords > 0 || values.count > 0;
+    // Copies of pages a writer replaced while a snapshot still held them are
+    // left behind when it closes, so those alone are not a problem
+    bool problemsFound = false;
+    for (const Problems *problems : all)
+        problemsFound = problemsFound || (problems != &stale && problems->count > 0);
+
+    if (recordsLost) {
+        cout << "status: records lost";
+        if (lostRecords > 0)
+            cout << " (" << lostRecords << " on orphaned chains)";
+        cout << ", rebuild the index" << endl;
+        return 2;
+    }
+    if (!problemsFound) {
+        cout << "status: clean" << endl;
+        return 0;
+    }
+    if (!doRepair) {
+        cout << "status: repairable, run with --repair" << endl;
+        return 1;
+    }
+
+    repair(indexFName, *indexFile, header, pages, chains, next, layout, format);
+    cout << "status: repaired, " << header.numRecords << " records in " << header.numBuckets << " buckets" << endl;
+    return 1;
+}
@@ -12,29 +12,112 @@ Skeleton code for linear hash indexing
 #include <sstream>
 #include <stdexcept>
 #include <cmath>
+#include <csignal>
+#include <thread>
 #include "classes.h"
+#include "server.h"
+#include "column_file.h"
+#include "shared_index.h"
+#include "sharded_index.h"
 using namespace std;
 
+// Server to stop on SIGINT/SIGTERM in --serve mode
+static IndexServer *runningServer = nullptr;
 
-int main(int argc, char* const argv[]) {
+static void stopServer(int)
+{
+    if (runningServer != nullptr)
+        runningServer->stop();
+}
 
-    // Create the index
-    LinearHashIndex emp_index("EmployeeIndex.idx");  // Assuming .idx extension for clarity
-    emp_index.createFromFile("Employee.csv");
+// Look up every ID in idsPath ('-' for stdin), one per line, and write one
+// result per ID to stdout in input order. IDs are looked up in chunks through
+// the batch lookup pipeline and output is written in large buffered blocks.
+//   csv:    found IDs as "id,name,bio,manager_id", missing IDs as just "id"
+//   binary: per ID [found:uint8] then the record in the server's wire format
+//           when found, or [id:int64] when not
+template <typename Index>
+static int runBatch(Index &index, const string &idsPath, const string &format)
+{
+    const size_t CHUNK_SIZE = 65536;
+
+    if (format != "csv" && format != "binary") {
+        cerr << "Unknown output format '" << format << "', expected csv or binary" << endl;
+        return 1;
+    }
+    bool binary = format == "binary";
 
-    // Loop to lookup IDs until user is ready to quit
+    istream *in = &cin;
+    ifstream idsFile;
+    if (idsPath != "-") {
+        idsFile.open(idsPath);
+        if (!idsFile.is_open()) {
+            cerr << "Cannot open " << idsPath << endl;
+            return 1;
+        }
+        in = &idsFile;
+    }
+
+    static char outputBuffer[1 << 20];
+    setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+
+    vector<int64_t> ids;
+    auto writeChunk = [&]() {
+        vector<Record> found = index.findRecordsByIds(ids);
+
+        Protocol::Writer out;
+        for (size_t k = 0; k < ids.size(); k++) {
+            if (binary) {
+                out.put((uint8_t)(found[k].id != -1));
+                if (found[k].id != -1)
+                    out.putRecord(found[k]);
+                else
+                    out.put(ids[k]);
+            } else if (found[k].id != -1) {
+                out.out += to_string(found[k].id) + ',' + found[k].name + ',' + found[k].bio + ',' +
+                           to_string(found[k].manager_id) + '\n';
+            } else {
+                out.out += to_string(ids[k]) + '\n';
+            }
+        }
+        fwrite(out.out.data(), 1, out.out.length(), stdout);
+        ids.clear();
+    };
+
+    string line;
+    while (getline(*in, line)) {
+        if (line.empty())
+            continue;
+        try {
+            ids.push_back(stoll(line));
+        } catch (const exception &e) {
+            cerr << "Skipping invalid ID: " << line << "\n";
+            continue;
+        }
+        if (ids.size() == CHUNK_SIZE)
+            writeChunk();
+    }
+    writeChunk();
+    fflush(stdout);
+    return 0;
+}
+
+// Loop to lookup IDs until user is ready to quit
+template <typename Index>
+static void runPrompt(Index &index)
+{
     while (true) {
         cout << "Enter an employee ID to look up, or type 'quit' to exit: ";
         string input;
         getline(cin, input);
 
-        if (input == "quit") {
+        if (input == "quit" || !cin) {
             break;  // Exit the loop if the user types 'quit'
         }
 
         try {
-            int id = stoi(input);  // Convert input to integer
-            Record foundRecord = emp_index.findRecordById(id);
+            int64_t id = stoll(input);  // Convert input to integer
+            Record foundRecord = index.findRecordById(id);
 
             if (foundRecord.id != -1) { // Assuming -1 indicates not found
                 foundRecord.print();
@@ -45,10 +128,98 @@ int main(int argc, char* const argv[]) {
             // Handle case where the input cannot be converted to an integer
             cout << "Invalid ID. Please enter a numeric ID." << endl;
         } catch (const out_of_range& e) {
-            // Handle case where the input integer is out of the range of int
+            // Handle case where the input integer is out of the range of int64_t
             cout << "ID out of range. Please enter a smaller ID." << endl;
         }
     }
+}
+
+// Answer lookups from the prompt, or from a file of IDs when the arguments
+// from argv[next] on are --batch <ids file> [csv|binary]
+template <typename Index>
+static int runQueries(Index &index, int argc, char* const argv[], int next)
+{
+    if (argc >= next + 2 && string(argv[next]) == "--batch") {
+        return runBatch(index, argv[next + 1], argc >= next + 3 ? argv[next + 2] : "csv");
+    }
+    runPrompt(index);
+    return 0;
+}
+
+
+int main(int argc, char* const argv[]) {
+
+    // Build the next version of a shared index from Employee.csv and make
+    // it current for every reader:
+    //   --publish <base name>
+    if (argc >= 3 && string(argv[1]) == "--publish") {
+        IndexPublisher publisher(argv[2]);
+        LinearHashIndex next(publisher.nextIndexName());
+        next.createFromFile("Employee.csv");
+        publisher.publish();
+        cout << "Published version " << publisher.currentVersion() << " of " << argv[2] << endl;
+        return 0;
+    }
+
+    // Look up IDs in the latest published version of a shared index,
+    // switching to newer versions as they are published:
+    //   --serve-shared <base name> [--batch <ids file> [csv|binary]]
+    if (argc >= 3 && string(argv[1]) == "--serve-shared") {
+        SharedIndexReader reader(argv[2]);
+        return runQueries(reader, argc, argv, 3);
+    }
+
+    // Build the index from Employee.csv as several shard files,
+    // EmployeeIndex.idx.0 and on, and look up IDs in it:
+    //   --shards <count, a power of two> [--batch <ids file> [csv|binary]]
+    if (argc >= 3 && string(argv[1]) == "--shards") {
+        int numShards = stoi(argv[2]);
+        if (numShards < 1 || numShards > 1024 || (numShards & (numShards - 1)) != 0) {
+            cerr << "Shard count must be a power of two up to 1024" << endl;
+            return 1;
+        }
+        ShardedIndex sharded(ShardedIndex::shardNames("EmployeeIndex.idx", numShards));
+        sharded.createFromFile("Employee.csv");
+        return runQueries(sharded, argc, argv, 3);
+    }
+
+    // Create the index
+    LinearHashIndex emp_index("EmployeeIndex.idx");  // Assuming .idx extension for clarity
+    emp_index.createFromFile("Employee.csv");
+
+    // Answer a file of IDs without prompting:
+    //   --batch <ids file, or - for stdin> [csv|binary]
+    if (argc >= 3 && string(argv[1]) == "--batch") {
+        return runQueries(emp_index, argc, argv, 1);
+    }
+
+    // Serve lookups over a Unix domain socket instead of prompting:
+    //   --serve <socket path> [worker threads]
+    if (argc >= 3 && string(argv[1]) == "--serve") {
+        int workers = argc >= 4 ? stoi(argv[3]) : (int)thread::hardware_concurrency();
+        IndexServer server(emp_index, argv[2], workers);
+
+        runningServer = &server;
+        signal(SIGINT, stopServer);
+        signal(SIGTERM, stopServer);
+        signal(SIGPIPE, SIG_IGN);
+
+        cout << "Serving " << argv[2] << endl;
+        server.run();
+        runningServer = nullptr;
+        return 0;
+    }
+
+    // Write every record to a column file for analytics:
+    //   --export <column file> [threads]
+    if (argc >= 3 && string(argv[1]) == "--export") {
+        int threads = argc >= 4 ? stoi(argv[3]) : (int)thread::hardware_concurrency();
+        int64_t rows = ColumnExport::run(emp_index, argv[2], threads);
+        cout << "Exported " << rows << " records to " << argv[2] << endl;
+        return 0;
+    }
+
+    runPrompt(emp_index);
 
     return 0;
 }
@@ -0,0 +1,648 @@
+#ifndef PAGE_IO_H
+#define PAGE_IO_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define PAGE_IO_HAVE_URING 1
+#endif
+#endif
+#ifndef PAGE_IO_HAVE_URING
+#define PAGE_IO_HAVE_URING 0
+#endif
+
+using namespace std;
+
+// Positional I/O on one file. Synchronous reads and writes go straight to the
+// file; asynchronous reads are queued with submitRead and collected with
+// waitForReads so callers can keep many reads in flight at once.
+class FileIO
+{
+protected:
+    int fd;
+
+    // Reads completed by the synchronous fallback, waiting to be collected
+    vector<uint64_t> completed;
+
+public:
+    FileIO(int fileDescriptor)
+    {
+        fd = fileDescriptor;
+    }
+
+    virtual ~FileIO()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    FileIO(const FileIO &) = delete;
+    FileIO &operator=(const FileIO &) = delete;
+
+    // Read len bytes at offset. Bytes past the end of the file read as zero.
+    virtual void read(int64_t offset, char *buf, size_t len)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t n = pread(fd, buf + done, len - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                throw runtime_error("pread failed: " + string(strerror(errno)));
+            if (n == 0)
+            {
+                memset(buf + done, 0, len - done);
+                break;
+            }
+            done += n;
+        }
+    }
+
+    virtual void write(int64_t offset, const char *buf, size_t len)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                throw runtime_error("pwrite failed: " + string(strerror(errno)));
+            done += n;
+        }
+    }
+
+    // Queue a read; its tag is returned by waitForReads once buf is filled
+    virtual void submitRead(int64_t offset, char *buf, size_t len, uint64_t tag)
+    {
+        read(offset, buf, len);
+        completed.push_back(tag);
+    }
+
+    // Append the tags of finished reads to done. With block set, waits until
+    // at least one has finished if any are outstanding; otherwise only
+    // collects what is already finished. Returns the number appended.
+    virtual int waitForReads(vector<uint64_t> &done, bool block = true)
+    {
+        (void)block;
+        int n = completed.size();
+        done.insert(done.end(), completed.begin(), completed.end());
+        completed.clear();
+        return n;
+    }
+
+    // Pointer to the len bytes at offset when the file is held in memory, so
+    // callers can use them in place; nullptr otherwise
+    virtual const char *memoryAt(int64_t offset, size_t len)
+    {
+        (void)offset;
+        (void)len;
+        return nullptr;
+    }
+
+    // Flush everything written so far to disk
+    virtual void sync()
+    {
+        if (fsync(fd) != 0)
+            throw runtime_error("fsync failed: " + string(strerror(errno)));
+    }
+
+    virtual const char *backendName()
+    {
+        return "pread";
+    }
+};
+
+// A file held entirely in memory. Nothing reaches the disk until saveTo.
+// The bytes live in reserved address ranges that are committed as the file
+// grows and never move, so pointers from memoryAt stay valid while the file
+// is written to. Each new range is as large as all earlier ones together, so
+// a file of n bytes reserves less than 2n of address space.
+class MemoryFileIO : public FileIO
+{
+private:
+    static const size_t FIRST_RESERVE = 16 << 20;
+    static const size_t COMMIT_STEP = 1 << 20;
+    static const int MAX_SEGMENTS = 48;
+
+    struct Segment
+    {
+        char *bytes;
+        size_t start;
+        size_t size;
+    };
+
+    // Entries below numSegments never change, so readers need no lock
+    Segment segments[MAX_SEGMENTS];
+    atomic<int> numSegments;
+    size_t reserved;  // End of the last segment
+    size_t committed; // Bytes writable from the start of the file
+    atomic<size_t> length;
+
+    const Segment &segmentAt(size_t offset) const
+    {
+        int k = numSegments.load(memory_order_acquire) - 1;
+        while (segments[k].start > offset)
+            k--;
+        return segments[k];
+    }
+
+    // Reserve another range, at least large enough to reach newLength
+    void reserve(size_t newLength)
+    {
+        int k = numSegments.load(memory_order_relaxed);
+        if (k == MAX_SEGMENTS)
+            throw length_error("In-memory file cannot grow past " + to_string(reserved) + " bytes");
+
+        size_t size = max(reserved, newLength - reserved);
+        if (size < FIRST_RESERVE)
+            size = FIRST_RESERVE;
+        size = (size + COMMIT_STEP - 1) / COMMIT_STEP * COMMIT_STEP;
+        void *addr = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED)
+            throw runtime_error("Cannot reserve memory for in-memory file: " + string(strerror(errno)));
+
+        segments[k].bytes = (char *)addr;
+        segments[k].start = reserved;
+        segments[k].size = size;
+        reserved += size;
+        numSegments.store(k + 1, memory_order_release);
+    }
+
+    // Make the first newLength bytes writable
+    void commit(size_t newLength)
+    {
+        while (committed < newLength)
+        {
+            if (committed == reserved)
+                reserve(newLength);
+
+            const Segment &seg = segmentAt(committed);
+            size_t newCommitted = (newLength + COMMIT_STEP - 1) / COMMIT_STEP * COMMIT_STEP;
+            newCommitted = min(newCommitted, seg.start + seg.size);
+            if (mprotect(seg.bytes + (committed - seg.start), newCommitted - committed, PROT_READ | PROT_WRITE) != 0)
+                throw runtime_error("Cannot grow in-memory file: " + string(strerror(errno)));
+            committed = newCommitted;
+        }
+    }
+
+    // Run visit(pointer, offset, len) on each contiguous piece of a byte range
+    template <typename Visit>
+    void forEachPiece(size_t offset, size_t len, Visit visit) const
+    {
+        while (len > 0)
+        {
+            const Segment &seg = segmentAt(offset);
+            size_t n = min(len, seg.start + seg.size - offset);
+            visit(seg.bytes + (offset - seg.start), offset, n);
+            offset += n;
+            len -= n;
+        }
+    }
+
+public:
+    MemoryFileIO() : FileIO(-1)
+    {
+        numSegments = 0;
+        reserved = 0;
+        committed = 0;
+        length = 0;
+    }
+
+    ~MemoryFileIO()
+    {
+        for (int k = 0; k < numSegments.load(memory_order_relaxed); k++)
+            munmap(segments[k].bytes, segments[k].size);
+    }
+
+    void read(int64_t offset, char *buf, size_t len) override
+    {
+        size_t size = length.load(memory_order_acquire);
+        size_t available = offset < (int64_t)size ? min(len, size - offset) : 0;
+        forEachPiece(offset, available, [&](const char *piece, size_t pieceOffset, size_t n) {
+            memcpy(buf + (pieceOffset - offset), piece, n);
+        });
+        memset(buf + available, 0, len - available);
+    }
+
+    // Bytes become visible to memoryAt only once fully written
+    void write(int64_t offset, const char *buf, size_t len) override
+    {
+        commit(offset + len);
+        forEachPiece(offset, len, [&](char *piece, size_t pieceOffset, size_t n) {
+            memcpy(piece, buf + (pieceOffset - offset), n);
+        });
+        if (offset + len > length.load(memory_order_relaxed))
+            length.store(offset + len, memory_order_release);
+    }
+
+    // nullptr also when the bytes straddle two reserved ranges; callers then
+    // read them
+    const char *memoryAt(int64_t offset, size_t len) override
+    {
+        if (offset >= (int64_t)length.load(memory_order_acquire))
+            return nullptr;
+        const Segment &seg = segmentAt(offset);
+        if (offset + len > seg.start + seg.size)
+            return nullptr;
+        return seg.bytes + (offset - seg.start);
+    }
+
+    const char *backendName() override
+    {
+        return "memory";
+    }
+
+    // Replace the contents with those of the file at path
+    void loadFrom(const string &path)
+    {
+        int fileFd = open(path.c_str(), O_RDONLY);
+        if (fileFd < 0)
+            throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+        FileIO file(fileFd);
+        struct stat st;
+        if (fstat(fileFd, &st) != 0)
+            throw runtime_error("Cannot stat " + path + ": " + strerror(errno));
+
+        forEachPiece(0, length.load(memory_order_relaxed), [](char *piece, size_t, size_t n) {
+            memset(piece, 0, n);
+        });
+        commit(st.st_size);
+        forEachPiece(0, st.st_size, [&](char *piece, size_t pieceOffset, size_t n) {
+            file.read(pieceOffset, piece, n);
+        });
+        length.store(st.st_size, memory_order_release);
+    }
+
+    // Nothing to flush until saveTo
+    void sync() override
+    {
+    }
+
+    // Write the contents to path and flush them to disk
+    void saveTo(const string &path)
+    {
+        int fileFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fileFd < 0)
+            throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+        FileIO file(fileFd);
+        forEachPiece(0, length.load(memory_order_relaxed), [&](const char *piece, size_t pieceOffset, size_t n) {
+            file.write(pieceOffset, piece, n);
+        });
+        file.sync();
+    }
+};
+
+#if PAGE_IO_HAVE_URING
+// io_uring backend driven through the raw system calls, so no liburing is
+// needed. Writes stay synchronous; only reads are queued on the ring.
+class IoUringFileIO : public FileIO
+{
+private:
+    struct PendingRead
+    {
+        int64_t offset;
+        char *buf;
+        size_t len;
+        uint64_t tag;
+    };
+
+    int ringFd;
+    unsigned ringEntries;
+
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize, cqRingSize;
+    io_uring_sqe *sqes;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    // Requests on the ring, indexed by user_data
+    vector<PendingRead> slots;
+    vector<uint64_t> freeSlots;
+    unsigned toSubmit;
+    unsigned inFlight;
+
+    IoUringFileIO(int fileDescriptor) : FileIO(fileDescriptor)
+    {
+        ringFd = -1;
+        sqRing = cqRing = MAP_FAILED;
+        sqes = (io_uring_sqe *)MAP_FAILED;
+        toSubmit = 0;
+        inFlight = 0;
+    }
+
+    bool setup(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        ringFd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd < 0)
+            return false;
+        ringEntries = params.sq_entries;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe *)mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+            return false;
+
+        char *sq = (char *)sqRing;
+        sqHead = (unsigned *)(sq + params.sq_off.head);
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + params.sq_off.array);
+
+        char *cq = (char *)cqRing;
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    int enter(unsigned submit, unsigned minComplete)
+    {
+        unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int ret;
+        do
+        {
+            ret = syscall(__NR_io_uring_enter, ringFd, submit, minComplete, flags, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    void flushSubmissions(unsigned minComplete)
+    {
+        int ret = enter(toSubmit, minComplete);
+        if (ret < 0)
+            throw runtime_error("io_uring_enter failed: " + string(strerror(errno)));
+        toSubmit -= ret;
+    }
+
+    // Move finished requests from the completion ring to done
+    int reapCompletions(vector<uint64_t> &done)
+    {
+        int n = 0;
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe &cqe = cqes[head & *cqMask];
+            PendingRead &req = slots[cqe.user_data];
+
+            // Short or failed reads are finished synchronously
+            if (cqe.res < 0)
+                read(req.offset, req.buf, req.len);
+            else if ((size_t)cqe.res < req.len)
+                read(req.offset + cqe.res, req.buf + cqe.res, req.len - cqe.res);
+
+            done.push_back(req.tag);
+            freeSlots.push_back(cqe.user_data);
+            inFlight--;
+            head++;
+            n++;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+public:
+    ~IoUringFileIO()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, ringEntries * sizeof(io_uring_sqe));
+        if (cqRing != MAP_FAILED)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (ringFd >= 0)
+            close(ringFd);
+    }
+
+    // Returns nullptr when the kernel does not allow io_uring
+    static IoUringFileIO *create(int fileDescriptor, unsigned entries)
+    {
+        IoUringFileIO *io = new IoUringFileIO(fileDescriptor);
+        if (!io->setup(entries))
+        {
+            io->fd = -1; // Keep the descriptor open for the fallback
+            delete io;
+            return nullptr;
+        }
+        return io;
+    }
+
+    void submitRead(int64_t offset, char *buf, size_t len, uint64_t tag) override
+    {
+        // Ring full: wait for some room before queueing more
+        while (inFlight >= ringEntries)
+        {
+            flushSubmissions(1);
+            reapCompletions(completed);
+        }
+
+        uint64_t slot;
+        if (!freeSlots.empty())
+        {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else
+        {
+            slot = slots.size();
+            slots.push_back(PendingRead());
+        }
+        slots[slot] = {offset, buf, len, tag};
+
+        unsigned tail = *sqTail;
+        unsigned idx = tail & *sqMask;
+        io_uring_sqe &sqe = sqes[idx];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.off = offset;
+        sqe.addr = (uint64_t)(uintptr_t)buf;
+        sqe.len = len;
+        sqe.user_data = slot;
+        sqArray[idx] = idx;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        toSubmit++;
+        inFlight++;
+    }
+
+    int waitForReads(vector<uint64_t> &done, bool block = true) override
+    {
+        int n = FileIO::waitForReads(done);
+        if (inFlight == 0)
+            return n;
+
+        // Submit anything queued and only block if nothing is ready yet
+        flushSubmissions(0);
+        n += reapCompletions(done);
+        if (n == 0 && block)
+        {
+            flushSubmissions(1);
+            n += reapCompletions(done);
+        }
+        return n;
+    }
+
+    const char *backendName() override
+    {
+        return "io_uring";
+    }
+};
+#endif
+
+// Read-only shared mapping of a whole file, so reads are plain memory loads
+// served from the page cache. The mapping may reach past the end of the file
+// so it stays usable as the file grows; only bytes written before a read may
+// be read through it.
+class MappedFile
+{
+private:
+    const char *base;
+    size_t length;
+
+    MappedFile()
+    {
+        base = nullptr;
+        length = 0;
+    }
+
+public:
+    ~MappedFile()
+    {
+        if (base != nullptr)
+            munmap(const_cast<char *>(base), length);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // Map at least minLength bytes, or the whole file if it is longer
+    static unique_ptr<MappedFile> map(const string &path, int64_t minLength = 0)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            throw runtime_error("Cannot stat " + path + ": " + strerror(errno));
+        }
+
+        unique_ptr<MappedFile> mapped(new MappedFile());
+        mapped->length = max((int64_t)st.st_size, minLength);
+        if (mapped->length > 0)
+        {
+            void *addr = mmap(nullptr, mapped->length, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                close(fd);
+                throw runtime_error("Cannot map " + path + ": " + strerror(errno));
+            }
+            mapped->base = (const char *)addr;
+        }
+        close(fd);
+        return mapped;
+    }
+
+    const char *at(int64_t offset) const
+    {
+        return base + offset;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+};
+
+// Ask the CPU to start loading len bytes at addr into cache
+static inline void prefetchBytes(const char *addr, size_t len)
+{
+#if defined(__GNUC__)
+    for (size_t off = 0; off < len; off += 64)
+        __builtin_prefetch(addr + off, 0, 3);
+#else
+    (void)addr;
+    (void)len;
+#endif
+}
+
+// Flush a file that is not open to disk
+static inline void syncFile(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+    FileIO file(fd);
+    file.sync();
+}
+
+// Flush the directory holding path, so files created or renamed in it
+// survive a crash
+static inline void syncDirectoryOf(const string &path)
+{
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        throw runtime_error("Cannot open " + dir + ": " + strerror(errno));
+    FileIO file(fd);
+    file.sync();
+}
+
+// Open a file for positional I/O, using io_uring for reads when requested and
+// available and plain pread otherwise. A read-only file must already exist.
+static inline unique_ptr<FileIO> openFileIO(const string &path, bool truncate, bool useIoUring, bool readOnly = false)
+{
+    int flags = readOnly ? O_RDONLY : O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0);
+    int fd = open(path.c_str(), flags, 0644);
+    if (fd < 0)
+        throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+#if PAGE_IO_HAVE_URING
+    if (useIoUring)
+    {
+        IoUringFileIO *io = IoUringFileIO::create(fd, 256);
+        if (io != nullptr)
+            return unique_ptr<FileIO>(io);
+    }
+#else
+    (void)useIoUring;
+#endif
+    return unique_ptr<FileIO>(new FileIO(fd));
+}
+
+#endif
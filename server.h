@@ -0,0 +1,705 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "classes.h"
+using namespace std;
+
+// Wire protocol for the lookup server. Every message in either direction is
+// a frame: [length:uint32][body], length counting the body. Integers are in
+// host byte order; the server only listens on a Unix domain socket, so both
+// ends run on the same machine.
+//
+// Request bodies start with an opcode:
+//   OP_LOOKUP        [id:int64]
+//   OP_BATCH_LOOKUP  [count:uint32][id:int64 x count]
+//   OP_INSERT        [record]
+// Response bodies start with a status:
+//   OP_LOOKUP        STATUS_OK [record] or STATUS_NOT_FOUND
+//   OP_BATCH_LOOKUP  STATUS_OK [count:uint32] then per id [found:uint8][record if found]
+//   OP_INSERT        STATUS_OK
+//   any, on failure  STATUS_ERROR or STATUS_BAD_REQUEST [messageLength:uint32][message]
+// A record is [id:int64][manager_id:int64][nameLength:uint32][name][bioLength:uint32][bio].
+class Protocol
+{
+public:
+    static const uint8_t OP_LOOKUP = 1;
+    static const uint8_t OP_BATCH_LOOKUP = 2;
+    static const uint8_t OP_INSERT = 3;
+
+    static const uint8_t STATUS_OK = 0;
+    static const uint8_t STATUS_NOT_FOUND = 1;
+    static const uint8_t STATUS_ERROR = 2;
+    static const uint8_t STATUS_BAD_REQUEST = 3;
+
+    // Larger frames are treated as a broken client
+    static const uint32_t MAX_FRAME_SIZE = 64 << 20;
+
+    // Builds a message body
+    class Writer
+    {
+    public:
+        string out;
+
+        template <typename T>
+        void put(T value)
+        {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        void putString(const string &value)
+        {
+            put((uint32_t)value.length());
+            out += value;
+        }
+
+        void putRecord(const Record &record)
+        {
+            put(record.id);
+            put(record.manager_id);
+            putString(record.name);
+            putString(record.bio);
+        }
+
+        // The body with its length prefix
+        string frame() const
+        {
+            uint32_t len = out.length();
+            return string(reinterpret_cast<const char *>(&len), sizeof(len)) + out;
+        }
+    };
+
+    // Parses a message body; every getter returns false once the body runs out
+    class Reader
+    {
+    private:
+        const string &in;
+        size_t pos;
+
+    public:
+        Reader(const string &body) : in(body)
+        {
+            pos = 0;
+        }
+
+        template <typename T>
+        bool get(T &value)
+        {
+            if (in.length() - pos < sizeof(value))
+                return false;
+            memcpy(&value, in.data() + pos, sizeof(value));
+            pos += sizeof(value);
+            return true;
+        }
+
+        bool getString(string &value)
+        {
+            uint32_t len;
+            if (!get(len) || in.length() - pos < len)
+                return false;
+            value.assign(in.data() + pos, len);
+            pos += len;
+            return true;
+        }
+
+        bool getRecord(Record &record)
+        {
+            return get(record.id) && get(record.manager_id) && getString(record.name) && getString(record.bio);
+        }
+    };
+};
+
+// Long-running lookup server on a Unix domain socket. One thread runs an
+// epoll loop that accepts connections and reads and writes frames; complete
+// requests are handed to a pool of worker threads. Each connection has at
+// most one request being worked on, so responses come back in request order.
+// Lookups run without a lock on the index's published snapshot; inserts
+// take insertLock, as the index allows only one at a time.
+class IndexServer
+{
+private:
+    struct Connection
+    {
+        int fd;
+        string in;
+        string out;
+        bool busy;
+    };
+
+    struct Job
+    {
+        uint64_t connId;
+        string request;
+    };
+
+    // epoll data values for the two non-connection descriptors
+    static const uint64_t LISTEN_ID = 0;
+    static const uint64_t WAKE_ID = 1;
+
+    // A connection with this many response bytes its client has not taken
+    // yet gets no more requests run until it drains
+    static const size_t MAX_PENDING_OUTPUT = 4 << 20;
+
+    LinearHashIndex &index;
+    mutex insertLock;
+    string socketPath;
+    int numWorkers;
+
+    int listenFd;
+    int epollFd;
+    int wakeFd;
+    atomic<bool> stopping;
+
+    unordered_map<uint64_t, Connection> connections;
+    uint64_t nextConnId;
+
+    mutex jobMutex;
+    condition_variable jobReady;
+    deque<Job> jobs;
+
+    mutex replyMutex;
+    vector<Job> replies;
+
+    static void setNonBlocking(int fd)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    static string errorResponse(uint8_t status, const string &message)
+    {
+        Protocol::Writer response;
+        response.put(status);
+        response.putString(message);
+        return response.out;
+    }
+
+    void wake()
+    {
+        uint64_t one = 1;
+        ssize_t ignored = ::write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    // Run one request against the index and build the response body
+    string handleRequest(const string &request)
+    {
+        Protocol::Reader reader(request);
+        Protocol::Writer response;
+
+        uint8_t op;
+        if (!reader.get(op))
+            return errorResponse(Protocol::STATUS_BAD_REQUEST, "Empty request");
+
+        try
+        {
+            if (op == Protocol::OP_LOOKUP)
+            {
+                int64_t id;
+                if (!reader.get(id))
+                    return errorResponse(Protocol::STATUS_BAD_REQUEST, "Malformed lookup");
+
+                Record found = index.findRecordById(id);
+                if (found.id == -1)
+                {
+                    response.put(Protocol::STATUS_NOT_FOUND);
+                }
+                else
+                {
+                    response.put(Protocol::STATUS_OK);
+                    response.putRecord(found);
+                }
+            }
+            else if (op == Protocol::OP_BATCH_LOOKUP)
+            {
+                uint32_t count;
+                if (!reader.get(count) || count > Protocol::MAX_FRAME_SIZE / sizeof(int64_t))
+                    return errorResponse(Protocol::STATUS_BAD_REQUEST, "Malformed batch lookup");
+
+                vector<int64_t> ids(count);
+                for (uint32_t k = 0; k < count; k++)
+                {
+                    if (!reader.get(ids[k]))
+                        return errorResponse(Protocol::STATUS_BAD_REQUEST, "Malformed batch lookup");
+                }
+
+                vector<Record> found = index.findRecordsByIds(ids);
+
+                response.put(Protocol::STATUS_OK);
+                response.put(count);
+                for (uint32_t k = 0; k < count; k++)
+                {
+                    response.put((uint8_t)(found[k].id != -1));
+                    if (found[k].id != -1)
+                        response.putRecord(found[k]);
+                }
+            }
+            else if (op == Protocol::OP_INSERT)
+            {
+                Record record;
+                if (!reader.getRecord(record))
+                    return errorResponse(Protocol::STATUS_BAD_REQUEST, "Malformed insert");
+
+                lock_guard<mutex> lock(insertLock);
+                index.insert(record);
+                response.put(Protocol::STATUS_OK);
+            }
+            else
+            {
+                return errorResponse(Protocol::STATUS_BAD_REQUEST, "Unknown opcode " + to_string(op));
+            }
+        }
+        catch (const exception &e)
+        {
+            return errorResponse(Protocol::STATUS_ERROR, e.what());
+        }
+        return response.out;
+    }
+
+    void workerLoop()
+    {
+        while (true)
+        {
+            Job job;
+            {
+                unique_lock<mutex> lock(jobMutex);
+                jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+
+            job.request = handleRequest(job.request);
+
+            {
+                lock_guard<mutex> lock(replyMutex);
+                replies.push_back(move(job));
+            }
+            wake();
+        }
+    }
+
+    void closeConnection(uint64_t connId)
+    {
+        auto it = connections.find(connId);
+        if (it == connections.end())
+            return;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        close(it->second.fd);
+        connections.erase(it);
+    }
+
+    // Whether the next request of the connection may be run now
+    static bool takesRequests(const Connection &conn)
+    {
+        return !conn.busy && conn.out.length() < MAX_PENDING_OUTPUT;
+    }
+
+    // Reading stops while a request is in progress or responses pile up, so
+    // a client that keeps sending without reading cannot make conn.in or
+    // conn.out grow without bound
+    void watch(uint64_t connId, Connection &conn)
+    {
+        epoll_event ev;
+        ev.events = (takesRequests(conn) ? (uint32_t)EPOLLIN : 0u) | (conn.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+        ev.data.u64 = connId;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &ev);
+    }
+
+    // Whether conn.in holds a whole frame
+    static bool hasFrame(const Connection &conn)
+    {
+        if (conn.in.length() < sizeof(uint32_t))
+            return false;
+        uint32_t len;
+        memcpy(&len, conn.in.data(), sizeof(len));
+        return conn.in.length() - sizeof(len) >= len;
+    }
+
+    // Hand the next complete frame to the workers if the connection takes one
+    void dispatch(uint64_t connId, Connection &conn)
+    {
+        if (!takesRequests(conn) || !hasFrame(conn))
+            return;
+
+        uint32_t len;
+        memcpy(&len, conn.in.data(), sizeof(len));
+        {
+            lock_guard<mutex> lock(jobMutex);
+            jobs.push_back({connId, conn.in.substr(sizeof(len), len)});
+        }
+        jobReady.notify_one();
+
+        conn.in.erase(0, sizeof(len) + len);
+        conn.busy = true;
+        watch(connId, conn);
+    }
+
+    // Returns false if the connection was closed. A request held back while
+    // the responses drained is dispatched once they have.
+    bool flush(uint64_t connId, Connection &conn)
+    {
+        while (!conn.out.empty())
+        {
+            ssize_t n = ::write(conn.fd, conn.out.data(), conn.out.length());
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n < 0)
+            {
+                closeConnection(connId);
+                return false;
+            }
+            conn.out.erase(0, n);
+        }
+        watch(connId, conn);
+        dispatch(connId, conn);
+        return true;
+    }
+
+    void acceptConnections()
+    {
+        while (true)
+        {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0)
+                return;
+            setNonBlocking(fd);
+
+            uint64_t connId = nextConnId++;
+            connections[connId] = {fd, string(), string(), false};
+
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = connId;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+
+    // Read until a whole frame is buffered; the rest waits in the socket
+    // until the connection takes requests again
+    void readConnection(uint64_t connId, Connection &conn)
+    {
+        char buf[65536];
+        while (!hasFrame(conn))
+        {
+            ssize_t n = ::read(conn.fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0)
+            {
+                closeConnection(connId);
+                return;
+            }
+            conn.in.append(buf, n);
+
+            if (conn.in.length() >= sizeof(uint32_t))
+            {
+                uint32_t len;
+                memcpy(&len, conn.in.data(), sizeof(len));
+                if (len > Protocol::MAX_FRAME_SIZE)
+                {
+                    closeConnection(connId);
+                    return;
+                }
+            }
+        }
+        dispatch(connId, conn);
+    }
+
+    // Move finished responses from the workers to their connections
+    void deliverReplies()
+    {
+        uint64_t count;
+        ssize_t ignored = ::read(wakeFd, &count, sizeof(count));
+        (void)ignored;
+
+        vector<Job> done;
+        {
+            lock_guard<mutex> lock(replyMutex);
+            done.swap(replies);
+        }
+
+        for (Job &reply : done)
+        {
+            auto it = connections.find(reply.connId);
+            if (it == connections.end())
+                continue; // Client went away while its request ran
+
+            Connection &conn = it->second;
+            uint32_t len = reply.request.length();
+            conn.out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+            conn.out += reply.request;
+            conn.busy = false;
+            flush(reply.connId, conn);
+        }
+    }
+
+public:
+    IndexServer(LinearHashIndex &servedIndex, string path, int workers) : index(servedIndex)
+    {
+        socketPath = path;
+        numWorkers = workers > 0 ? workers : 1;
+        listenFd = epollFd = wakeFd = -1;
+        stopping = false;
+        nextConnId = 2;
+    }
+
+    ~IndexServer()
+    {
+        for (auto &entry : connections)
+            close(entry.second.fd);
+        if (listenFd >= 0)
+        {
+            close(listenFd);
+            unlink(socketPath.c_str());
+        }
+        if (epollFd >= 0)
+            close(epollFd);
+        if (wakeFd >= 0)
+            close(wakeFd);
+    }
+
+    // Serve until stop() is called
+    void run()
+    {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socketPath.length() >= sizeof(addr.sun_path))
+            throw invalid_argument("Socket path too long: " + socketPath);
+        strcpy(addr.sun_path, socketPath.c_str());
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socketPath.c_str());
+        if (listenFd < 0 || bind(listenFd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 128) != 0)
+            throw runtime_error("Cannot listen on " + socketPath + ": " + strerror(errno));
+        setNonBlocking(listenFd);
+
+        // wakeFd is created before the workers so stop() can use it right away
+        epollFd = epoll_create1(0);
+        wakeFd = eventfd(0, EFD_NONBLOCK);
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = LISTEN_ID;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+        ev.data.u64 = WAKE_ID;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+        vector<thread> workers;
+        for (int w = 0; w < numWorkers; w++)
+            workers.push_back(thread(&IndexServer::workerLoop, this));
+
+        epoll_event events[64];
+        while (!stopping)
+        {
+            int n = epoll_wait(epollFd, events, 64, -1);
+            for (int e = 0; e < n; e++)
+            {
+                uint64_t id = events[e].data.u64;
+                if (id == LISTEN_ID)
+                {
+                    acceptConnections();
+                    continue;
+                }
+                if (id == WAKE_ID)
+                {
+                    deliverReplies();
+                    continue;
+                }
+
+                auto it = connections.find(id);
+                if (it == connections.end())
+                    continue;
+                if (events[e].events & (EPOLLERR | EPOLLHUP))
+                {
+                    closeConnection(id);
+                    continue;
+                }
+                if ((events[e].events & EPOLLOUT) && !flush(id, it->second))
+                    continue;
+                if (events[e].events & EPOLLIN)
+                    readConnection(id, it->second);
+            }
+        }
+
+        {
+            lock_guard<mutex> lock(jobMutex);
+            jobs.clear();
+        }
+        jobReady.notify_all();
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    // Ask run() to return. Only writes to an eventfd, so it is safe to call
+    // from a signal handler.
+    void stop()
+    {
+        stopping = true;
+        if (wakeFd >= 0)
+            wake();
+    }
+};
+
+// Blocking client for the lookup server
+class IndexClient
+{
+private:
+    int fd;
+
+    bool readFully(char *buf, size_t len)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t n = ::read(fd, buf + done, len - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+        return true;
+    }
+
+    // Send one request body and return the response body
+    string call(const Protocol::Writer &request)
+    {
+        string frame = request.frame();
+        size_t done = 0;
+        while (done < frame.length())
+        {
+            ssize_t n = ::write(fd, frame.data() + done, frame.length() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw runtime_error("Lost connection to index server");
+            done += n;
+        }
+
+        uint32_t len;
+        if (!readFully(reinterpret_cast<char *>(&len), sizeof(len)))
+            throw runtime_error("Lost connection to index server");
+        string response(len, '\0');
+        if (!readFully(&response[0], len))
+            throw runtime_error("Lost connection to index server");
+        return response;
+    }
+
+    static void checkStatus(Protocol::Reader &reader, uint8_t status)
+    {
+        if (status == Protocol::STATUS_ERROR || status == Protocol::STATUS_BAD_REQUEST)
+        {
+            string message;
+            reader.getString(message);
+            throw runtime_error("Index server: " + message);
+        }
+    }
+
+public:
+    IndexClient(const string &socketPath)
+    {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            throw runtime_error("Cannot connect to " + socketPath + ": " + strerror(errno));
+        }
+    }
+
+    ~IndexClient()
+    {
+        close(fd);
+    }
+
+    IndexClient(const IndexClient &) = delete;
+    IndexClient &operator=(const IndexClient &) = delete;
+
+    // Returns an empty Record (id -1) when the id is not in the index
+    Record lookup(int64_t id)
+    {
+        Protocol::Writer request;
+        request.put(Protocol::OP_LOOKUP);
+        request.put(id);
+
+        string response = call(request);
+        Protocol::Reader reader(response);
+        uint8_t status = Protocol::STATUS_BAD_REQUEST;
+        reader.get(status);
+        checkStatus(reader, status);
+
+        Record found;
+        if (status == Protocol::STATUS_OK)
+            reader.getRecord(found);
+        return found;
+    }
+
+    vector<Record> lookupBatch(const vector<int64_t> &ids)
+    {
+        Protocol::Writer request;
+        request.put(Protocol::OP_BATCH_LOOKUP);
+        request.put((uint32_t)ids.size());
+        for (int64_t id : ids)
+            request.put(id);
+
+        string response = call(request);
+        Protocol::Reader reader(response);
+        uint8_t status = Protocol::STATUS_BAD_REQUEST;
+        reader.get(status);
+        checkStatus(reader, status);
+
+        uint32_t count = 0;
+        reader.get(count);
+        vector<Record> results(count);
+        for (uint32_t k = 0; k < count; k++)
+        {
+            uint8_t found = 0;
+            reader.get(found);
+            if (found)
+                reader.getRecord(results[k]);
+        }
+        return results;
+    }
+
+    void insert(const Record &record)
+    {
+        Protocol::Writer request;
+        request.put(Protocol::OP_INSERT);
+        request.putRecord(record);
+
+        string response = call(request);
+        Protocol::Reader reader(response);
+        uint8_t status = Protocol::STATUS_BAD_REQUEST;
+        reader.get(status);
+        checkStatus(reader, status);
+    }
+};
+
+#endif
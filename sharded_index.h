@@ -0,0 +1,278 @@
+#ifndef SHARDED_INDEX_H
+#define SHARDED_INDEX_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include "classes.h"
+using namespace std;
+
+// Splits the keys over several independent LinearHashIndex shards, each with
+// its own files, so shards can live on different disks and be built, loaded
+// and saved in parallel. The shard of a key comes from the high bits of a
+// multiplicative hash, independent of the low bits the shards use to pick
+// buckets. The number of shards is a power of two.
+class ShardedIndex
+{
+private:
+    vector<string> shardFNames;
+    vector<unique_ptr<LinearHashIndex>> shards;
+    unique_ptr<mutex[]> insertLocks; // One insert at a time per shard
+    int shardBits;
+
+    // Batches smaller than this are looked up shard by shard on the calling
+    // thread; starting threads would cost more than it saves
+    static const size_t PARALLEL_BATCH_SIZE = 4096;
+
+    // Run work(shardIdx) for every shard on its own thread. The first
+    // exception thrown is rethrown once all threads are done.
+    template <typename Work>
+    void forEachShard(Work work)
+    {
+        vector<exception_ptr> errors(shards.size());
+        vector<thread> workers;
+        for (size_t k = 0; k < shards.size(); k++)
+        {
+            workers.emplace_back([&work, &errors, k]() {
+                try
+                {
+                    work(k);
+                }
+                catch (...)
+                {
+                    errors[k] = current_exception();
+                }
+            });
+        }
+        for (thread &worker : workers)
+            worker.join();
+
+        for (exception_ptr &error : errors)
+        {
+            if (error)
+                rethrow_exception(error);
+        }
+    }
+
+    // Key of a CSV line, or false when the line is not a record the shard
+    // loader can read: the id and manager id must both be numbers
+    static bool parseKey(const string &line, int64_t &id)
+    {
+        stringstream s(line);
+        string field;
+        try
+        {
+            getline(s, field, ',');
+            id = stoll(field);
+            for (int k = 0; k < 3; k++)
+                getline(s, field, ',');
+            stoll(field);
+            return true;
+        }
+        catch (const logic_error &)
+        {
+            return false;
+        }
+    }
+
+    // Write each line of the CSV to the part file of its key's shard,
+    // skipping lines that are not records
+    void partitionCsv(const string &csvFName, const vector<string> &partFNames)
+    {
+        ifstream inputFile(csvFName);
+        if (!inputFile.is_open())
+            throw runtime_error("Cannot open " + csvFName);
+
+        vector<unique_ptr<ofstream>> parts;
+        for (const string &partFName : partFNames)
+        {
+            parts.emplace_back(new ofstream(partFName, ios::trunc));
+            if (!parts.back()->is_open())
+                throw runtime_error("Cannot write " + partFName);
+        }
+
+        string line;
+        while (getline(inputFile, line))
+        {
+            if (line.empty())
+                continue;
+            int64_t id;
+            if (!parseKey(line, id))
+            {
+                cerr << "Skipping invalid record: " << line.substr(0, 80) << "\n";
+                continue;
+            }
+            *parts[shardFor(id)] << line << '\n';
+        }
+        for (auto &part : parts)
+        {
+            part->close();
+            if (part->fail())
+                throw runtime_error("Cannot write the part files of " + csvFName);
+        }
+    }
+
+public:
+    // One shard per file name; the number of names must be a power of two
+    ShardedIndex(const vector<string> &shardFileNames, IndexOptions indexOptions = IndexOptions())
+        : shardFNames(shardFileNames)
+    {
+        size_t numShards = shardFNames.size();
+        if (numShards == 0 || (numShards & (numShards - 1)) != 0)
+        {
+            throw invalid_argument("Number of shards must be a power of two");
+        }
+
+        shardBits = 0;
+        while (((size_t)1 << shardBits) < numShards)
+            shardBits++;
+
+        for (const string &shardFName : shardFNames)
+            shards.emplace_back(new LinearHashIndex(shardFName, indexOptions));
+        insertLocks.reset(new mutex[numShards]);
+    }
+
+    // Shard files named <baseName>.0, <baseName>.1, ... in one directory
+    static vector<string> shardNames(const string &baseName, int numShards)
+    {
+        vector<string> names;
+        for (int k = 0; k < numShards; k++)
+            names.push_back(baseName + "." + to_string(k));
+        return names;
+    }
+
+    int numShards() const
+    {
+        return shards.size();
+    }
+
+    // Shard a key belongs to
+    int shardFor(int64_t id) const
+    {
+        if (shardBits == 0)
+            return 0;
+        return (int)(((uint64_t)id * 0xD6E8FEB86659FD93ULL) >> (64 - shardBits));
+    }
+
+    LinearHashIndex &shard(int shardIdx)
+    {
+        return *shards[shardIdx];
+    }
+
+    // Split the CSV by shard, then build every shard from its part at once
+    void createFromFile(const string &csvFName)
+    {
+        vector<string> partFNames;
+        for (const string &shardFName : shardFNames)
+            partFNames.push_back(shardFName + ".part.csv");
+        try
+        {
+            partitionCsv(csvFName, partFNames);
+            forEachShard([&](size_t k) {
+                shards[k]->createFromFile(partFNames[k]);
+            });
+        }
+        catch (...)
+        {
+            for (const string &partFName : partFNames)
+                remove(partFName.c_str());
+            throw;
+        }
+        for (const string &partFName : partFNames)
+            remove(partFName.c_str());
+    }
+
+    // Open every shard saved by createFromFile, insert or snapshot
+    void load()
+    {
+        forEachShard([&](size_t k) {
+            shards[k]->load();
+        });
+    }
+
+    // Write every shard kept in memory to its files
+    void snapshot()
+    {
+        forEachShard([&](size_t k) {
+            shards[k]->snapshot();
+        });
+    }
+
+    // Add one record to its shard. Inserts into different shards may run at
+    // the same time, and lookups may run alongside them.
+    void insert(Record record)
+    {
+        int shardIdx = shardFor(record.id);
+        lock_guard<mutex> lock(insertLocks[shardIdx]);
+        shards[shardIdx]->insert(record);
+    }
+
+    // Counters summed over the shards; longestChain is the longest of any
+    IndexStats getStats()
+    {
+        IndexStats total = IndexStats();
+        for (unique_ptr<LinearHashIndex> &shard : shards)
+        {
+            IndexStats stats = shard->getStats();
+            total.numRecords += stats.numRecords;
+            total.numBuckets += stats.numBuckets;
+            total.numBlocks += stats.numBlocks;
+            total.numOverflowBlocks += stats.numOverflowBlocks;
+            total.longestChain = max(total.longestChain, stats.longestChain);
+        }
+        return total;
+    }
+
+    Record findRecordById(int64_t id, uint32_t fields = Record::ALL_FIELDS)
+    {
+        return shards[shardFor(id)]->findRecordById(id, fields);
+    }
+
+    // Look up many ids, each shard's share through its own lookup pipeline.
+    // Large batches run the shards in parallel. Ids that are not found come
+    // back as an empty Record (id -1).
+    vector<Record> findRecordsByIds(const vector<int64_t> &ids, uint32_t fields = Record::ALL_FIELDS)
+    {
+        vector<vector<int64_t>> shardIds(shards.size());
+        vector<vector<size_t>> positions(shards.size());
+        for (size_t k = 0; k < ids.size(); k++)
+        {
+            int shardIdx = shardFor(ids[k]);
+            shardIds[shardIdx].push_back(ids[k]);
+            positions[shardIdx].push_back(k);
+        }
+
+        vector<Record> results(ids.size());
+        auto lookupShard = [&](size_t shardIdx) {
+            const vector<size_t> &shardPositions = positions[shardIdx];
+            shards[shardIdx]->lookupPipelined(
+                shardIds[shardIdx],
+                [&](size_t k, Record &found) {
+                    results[shardPositions[k]] = found;
+                },
+                256, fields);
+        };
+
+        if (ids.size() < PARALLEL_BATCH_SIZE || shards.size() == 1)
+        {
+            for (size_t shardIdx = 0; shardIdx < shards.size(); shardIdx++)
+                lookupShard(shardIdx);
+        }
+        else
+        {
+            forEachShard(lookupShard);
+        }
+        return results;
+    }
+};
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef SHARED_INDEX_H
+#define SHARED_INDEX_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "classes.h"
+using namespace std;
+
+// One builder process publishes indexes and any number of reader processes
+// serve lookups from read-only mappings of them, so all readers share one
+// copy of the pages in the page cache.
+//
+// Each published index is a complete set of index files built under a
+// versioned name, <base>.<version>. The current version number lives in
+// <base>.version as [magic:uint32][reserved:uint32][version:uint64]. Builder
+// and readers map that file shared, so a reader sees a new version as soon as
+// it is published and switches to it on its next lookup.
+class IndexVersionFile
+{
+private:
+    static const uint32_t MAGIC = 0x5245564C; // "LVER"
+    static const size_t FILE_SIZE = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+    void *mapped;
+    uint64_t *version;
+
+public:
+    IndexVersionFile(const string &baseName, bool writable)
+    {
+        string path = baseName + ".version";
+        int fd = open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+        if (fd < 0)
+            throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+
+        if (writable)
+        {
+            uint32_t magic = 0;
+            if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) || magic != MAGIC)
+            {
+                char header[FILE_SIZE];
+                memset(header, 0, sizeof(header));
+                memcpy(header, &MAGIC, sizeof(MAGIC));
+                if (pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header))
+                {
+                    close(fd);
+                    throw runtime_error("Cannot initialize " + path + ": " + strerror(errno));
+                }
+            }
+        }
+        else if (lseek(fd, 0, SEEK_END) < (off_t)FILE_SIZE)
+        {
+            close(fd);
+            throw runtime_error("No index has been published at " + baseName);
+        }
+
+        mapped = mmap(nullptr, FILE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+            throw runtime_error("Cannot map " + path + ": " + strerror(errno));
+        version = (uint64_t *)((char *)mapped + 2 * sizeof(uint32_t));
+    }
+
+    ~IndexVersionFile()
+    {
+        munmap(mapped, FILE_SIZE);
+    }
+
+    IndexVersionFile(const IndexVersionFile &) = delete;
+    IndexVersionFile &operator=(const IndexVersionFile &) = delete;
+
+    uint64_t get() const
+    {
+        return __atomic_load_n(version, __ATOMIC_ACQUIRE);
+    }
+
+    // Readers see the new version at once; it is on disk when this returns
+    void set(uint64_t newVersion)
+    {
+        __atomic_store_n(version, newVersion, __ATOMIC_RELEASE);
+        if (msync(mapped, FILE_SIZE, MS_SYNC) != 0)
+            throw runtime_error("Cannot flush version file: " + string(strerror(errno)));
+    }
+
+    static string indexName(const string &baseName, uint64_t version)
+    {
+        return baseName + "." + to_string(version);
+    }
+};
+
+// Builder side: build the next version under nextIndexName(), with
+// createFromFile or snapshot(), then publish() it
+class IndexPublisher
+{
+private:
+    string baseName;
+    IndexVersionFile versionFile;
+
+    static void removeIndexFiles(const string &indexName)
+    {
+        remove(indexName.c_str());
+        remove((indexName + ".heap").c_str());
+        remove((indexName + ".fsm").c_str());
+        remove((indexName + ".dir").c_str());
+    }
+
+    // Flush a built index to disk. The heap is there only in some formats.
+    static void syncIndexFiles(const string &indexName)
+    {
+        syncFile(indexName);
+        syncFile(indexName + ".fsm");
+        syncFile(indexName + ".dir");
+        if (access((indexName + ".heap").c_str(), F_OK) == 0)
+            syncFile(indexName + ".heap");
+        syncDirectoryOf(indexName);
+    }
+
+public:
+    IndexPublisher(const string &base) : baseName(base), versionFile(base, true)
+    {
+    }
+
+    uint64_t currentVersion() const
+    {
+        return versionFile.get();
+    }
+
+    string nextIndexName() const
+    {
+        return IndexVersionFile::indexName(baseName, versionFile.get() + 1);
+    }
+
+    // Make the index built under nextIndexName() current. The version before
+    // the one being replaced is deleted; readers still using it keep their
+    // mappings and open files until they switch.
+    void publish()
+    {
+        // The files go to disk before the version number that names them, so
+        // a crash cannot leave it pointing at files that were never written
+        uint64_t published = versionFile.get() + 1;
+        syncIndexFiles(IndexVersionFile::indexName(baseName, published));
+        versionFile.set(published);
+        if (published > 2)
+            removeIndexFiles(IndexVersionFile::indexName(baseName, published - 2));
+    }
+};
+
+// Reader side: serves lookups from the latest published index, mapped
+// read-only. Safe to share between threads of a reader process.
+class SharedIndexReader
+{
+private:
+    string baseName;
+    IndexOptions options;
+    IndexVersionFile versionFile;
+
+    mutex reloadMutex;
+    shared_ptr<LinearHashIndex> current;
+    atomic<uint64_t> loadedVersion;
+
+    // Open the published version. A version can be deleted between reading
+    // its number and opening it when two are published in quick succession,
+    // so retry while the number keeps moving.
+    void reload()
+    {
+        while (true)
+        {
+            uint64_t version = versionFile.get();
+            if (version == 0)
+                throw runtime_error("No index has been published at " + baseName);
+
+            shared_ptr<LinearHashIndex> index = make_shared<LinearHashIndex>(
+                IndexVersionFile::indexName(baseName, version), options);
+            try
+            {
+                index->load();
+            }
+            catch (const runtime_error &)
+            {
+                if (versionFile.get() != version)
+                    continue;
+                throw;
+            }
+
+            atomic_store(&current, index);
+            loadedVersion = version;
+            return;
+        }
+    }
+
+public:
+    SharedIndexReader(const string &base, IndexOptions indexOptions = IndexOptions())
+        : baseName(base), options(indexOptions), versionFile(base, false)
+    {
+        options.mapIndex = true;
+        options.inMemory = false;
+        options.readOnly = true;
+        options.useIoUring = false;
+        loadedVersion = 0;
+        reload();
+    }
+
+    // The latest published index. Callers keep using the one they got even
+    // if a newer version is published meanwhile.
+    shared_ptr<LinearHashIndex> acquire()
+    {
+        shared_ptr<LinearHashIndex> index = atomic_load(&current);
+        if (versionFile.get() != loadedVersion)
+        {
+            lock_guard<mutex> lock(reloadMutex);
+            if (versionFile.get() != loadedVersion)
+                reload();
+            index = atomic_load(&current);
+        }
+        return index;
+    }
+
+    uint64_t version()
+    {
+        return loadedVersion;
+    }
+
+    Record findRecordById(int64_t id, uint32_t fields = Record::ALL_FIELDS)
+    {
+        return acquire()->findRecordById(id, fields);
+    }
+
+    vector<Record> findRecordsByIds(const vector<int64_t> &ids, uint32_t fields = Record::ALL_FIELDS)
+    {
+        return acquire()->findRecordsByIds(ids, fields);
+    }
+};
+
+#endif